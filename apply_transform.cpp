@@ -47,7 +47,9 @@ enum optionIndex {
     OUTPUT_PATH,
     TRANSFORM_PATH,
     INVERT_TRANSFORM,
-    INPUT_TRANSFORM_TYPE
+    INPUT_TRANSFORM_TYPE,
+    FIELD_PATH,
+    INTERPOLATION
 };
 
 
@@ -57,14 +59,79 @@ const option::Descriptor usage[] = {
     {HELP, 0, "h", "help", Arg::None, "--help, -h \tDisplay this help message and exit"},
     {MOVING_IMAGE, 0, "m", "moving", Arg::Required, "--moving, -m path \tPath to the moving image to apply the transform to."},
     {OUTPUT_PATH, 0, "o", "output", Arg::Required, "--output, -o path \tPath to save the transformed moving image"},
-    {TRANSFORM_PATH, 0, "t", "transform", Arg::Required, "--transform, -t path \tPath to the transform to apply"},
+    {TRANSFORM_PATH, 0, "t", "transform", Arg::Required, "--transform, -t path \tPath to the transform to apply\n"
+                                                         "Give --transform and --output once per warp of the moving image"},
     {INVERT_TRANSFORM, 0, "i", "invert", Arg::None, "--invert, -i \tInvert the given transform"},
     {INPUT_TRANSFORM_TYPE, 0, "r", "transform_type", Arg::Required, "--transform_type -r type \tType of the transform to be applied\n"
                                                                     "Default: itk::CompositeTransform"},
+    {FIELD_PATH, 0, "d", "field", Arg::Required, "--field, -d path \tPath to a displacement field to warp through instead of a transform,\n"
+                                                 "as saved by image_to_image_registration --displacement_field"},
+    {INTERPOLATION, 0, "p", "interpolation", Arg::Required, "--interpolation, -p type \tInterpolation: nearest, linear, bspline or sinc\n"
+                                                            "Default: bspline. Use nearest for label images, linear for quick previews"},
     {0,0,0,0,0,0}
 };
 
 
+template<unsigned int DIMENSIONS>
+int apply_transforms(option::Option* options, InterpolationMethod interpolation) {
+    // Warps the moving image through every transform, or through the displacement field, given in options
+    // Transforms and fields must have as many dimensions as the moving image
+    typedef itk::Image<float, DIMENSIONS> ImageType;
+    typedef itk::CompositeTransform<double, DIMENSIONS> CompositeTransformType;
+    typedef typename DisplacementFieldTypes<ImageType>::FIELD_TYPE FieldType;
+    typedef typename DisplacementFieldTypes<ImageType>::FIELD_TRANSFORM_TYPE FieldTransformType;
+
+    // Read image
+    typename ImageType::Pointer image = load_image<ImageType>(options[MOVING_IMAGE].arg);
+
+    // The moving image is decomposed into bspline coefficients once, for every transform it is warped through
+    BSplineCoefficientCache<ImageType> coefficient_cache;
+
+    // A displacement field is only looked up, the transform it was computed from is not evaluated again
+    if (options[FIELD_PATH]) {
+        if (read_image_dimension(options[FIELD_PATH].arg) != DIMENSIONS) {
+            cerr << "The displacement field must have as many dimensions as the moving image" << endl;
+            return 1;
+        }
+        typename FieldType::Pointer field = load_image<FieldType>(options[FIELD_PATH].arg);
+        if (!field_covers_grid<ImageType, FieldType>(field, image)) {
+            cerr << "The displacement field was computed on another grid than the moving image" << endl;
+            return 1;
+        }
+        image = apply_transform<ImageType, FieldTransformType>(image, create_field_transform<ImageType>(field), 0, interpolation, &coefficient_cache);
+        write_image<ImageType>(image, options[OUTPUT_PATH].arg);
+        return 0;
+    }
+
+    if (options[TRANSFORM_PATH].count() != options[OUTPUT_PATH].count()) {
+        cerr << "Please specify one output path for each transform." << endl;
+        return 1;
+    }
+
+    // If not inverse, apply normal transform
+    if (!options[INVERT_TRANSFORM]) {
+        option::Option* output = options[OUTPUT_PATH];
+        for (option::Option* opt = options[TRANSFORM_PATH]; opt; opt = opt->next(), output = output->next()) {
+            typename CompositeTransformType::Pointer transform = read_transform<CompositeTransformType>(opt->arg);
+            typename ImageType::Pointer transformed_image = apply_transform<ImageType, CompositeTransformType>(image, transform, 0, interpolation, &coefficient_cache);
+            write_image<ImageType>(transformed_image, output->arg);
+        }
+    } else {
+    // TODO: Temp message
+    cout << "Inverted transforms not supported yet!" << endl;
+    }
+
+    // Else, invert transform
+        // If has method (GetInverse) use inverse
+
+        // Else, use deformation field
+
+
+
+    return 0;
+}
+
+
 int main(int argc, char** argv) {
     // parse options
     argv += (argc > 0);
@@ -80,34 +147,32 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    if (!options[MOVING_IMAGE] || !options[OUTPUT_PATH] || !options[TRANSFORM_PATH]) {
+    if (!options[MOVING_IMAGE] || !options[OUTPUT_PATH] || !(options[TRANSFORM_PATH] || options[FIELD_PATH])) {
         cout << "Insufficient Arguments!!" << endl;
-        cout << "Please specify a moving image, an output path, and a transform to apply." << endl;
+        cout << "Please specify a moving image, an output path, and a transform or displacement field to apply." << endl;
         option::printUsage(cout, usage);
         return 1;
     }
 
-    // Read image
-    typedef itk::Image<float, 2> ImageType; 
-    ImageType::Pointer image = load_image<ImageType>(options[MOVING_IMAGE].arg);
-
-    // Read transform
-    COMPOSITE_TRANSFORM_TYPE::Pointer transform = read_transform<COMPOSITE_TRANSFORM_TYPE>(options[TRANSFORM_PATH].arg);
-
-    // If not inverse, apply normal transform
-    if (!options[INVERT_TRANSFORM]) {
-        image = apply_transform<ImageType, COMPOSITE_TRANSFORM_TYPE>(image, transform);
-    } else {
-    // TODO: Temp message
-    cout << "Inverted transforms not supported yet!" << endl;
+    InterpolationMethod interpolation = INTERPOLATE_BSPLINE;
+    unsigned int dimensions = 0;
+    try {
+        if (options[INTERPOLATION]) {
+            interpolation = parse_interpolation_method(options[INTERPOLATION].arg);
+        }
+        dimensions = read_image_dimension(options[MOVING_IMAGE].arg);
+        // Sections and volumes are warped the same way, picked by the dimension of the moving image
+        if (dimensions == 2) {
+            return apply_transforms<2>(options, interpolation);
+        } else if (dimensions == 3) {
+            return apply_transforms<3>(options, interpolation);
+        }
+    } catch (exception & err) {
+        cerr << err.what() << endl;
+        return 1;
     }
 
-    // Else, invert transform
-        // If has method (GetInverse) use inverse
-
-        // Else, use deformation field
-
-
-
-    return 0;
+    cerr << "Only 2d images and 3d volumes can be transformed, " << options[MOVING_IMAGE].arg
+         << " has " << dimensions << " dimensions" << endl;
+    return 1;
 }
@@ -1,12 +1,27 @@
 #include "itkImage.h"
 #include "itkResampleImageFilter.h"
-#include "itkBSplineInterpolateImageFunction.h"
+#include "itkNearestNeighborInterpolateImageFunction.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "itkBSplineResampleImageFunction.h"
+#include "itkWindowedSincInterpolateImageFunction.h"
+#include "itkBSplineDecompositionImageFilter.h"
+#include "itkBSplineInterpolationWeightFunction.h"
 #include "itkCompositeTransform.h"
+#include "itkDisplacementFieldTransform.h"
+#include "itkTransformToDisplacementFieldFilter.h"
 
 #include "optionparser.h"
 #include "image_io.h"
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
 #ifndef APPLY_TRANSFORM
 #define APPLY_TRANSFORM
@@ -14,29 +29,351 @@
 typedef itk::CompositeTransform<double, 2> COMPOSITE_TRANSFORM_TYPE;
 
 
-template<typename IMAGE_TYPE, typename TRANSFORM_TYPE>
-typename IMAGE_TYPE::Pointer apply_transform(typename IMAGE_TYPE::Pointer image, typename TRANSFORM_TYPE::Pointer transform) {
-    // Applys the transform to the image using bspline interpolation
-    typedef itk::ResampleImageFilter<IMAGE_TYPE, IMAGE_TYPE> ImageResamplerType;
-    typedef itk::BSplineInterpolateImageFunction<IMAGE_TYPE, double, double> InterpolatorType;
+// How apply_transform samples the input image between its pixels
+// Nearest neighbor keeps the values of label images, and linear is the cheapest smooth interpolation.
+//  Cubic bspline and windowed sinc are sharper, bspline needs the whole input decomposed into spline coefficients first
+enum InterpolationMethod {
+    INTERPOLATE_NEAREST,
+    INTERPOLATE_LINEAR,
+    INTERPOLATE_BSPLINE,
+    INTERPOLATE_SINC
+};
+
+
+inline InterpolationMethod parse_interpolation_method(const std::string& interpolation) {
+    if (interpolation == "nearest") {
+        return INTERPOLATE_NEAREST;
+    } else if (interpolation == "linear") {
+        return INTERPOLATE_LINEAR;
+    } else if (interpolation == "bspline") {
+        return INTERPOLATE_BSPLINE;
+    } else if (interpolation == "sinc") {
+        return INTERPOLATE_SINC;
+    }
+    throw std::invalid_argument("Unknown interpolation '" + interpolation + "', use nearest, linear, bspline or sinc");
+}
+
+
+inline const char* get_interpolation_method_name(InterpolationMethod interpolation) {
+    switch (interpolation) {
+        case INTERPOLATE_NEAREST:
+            return "nearest";
+        case INTERPOLATE_LINEAR:
+            return "linear";
+        case INTERPOLATE_SINC:
+            return "sinc";
+        default:
+            return "bspline";
+    }
+}
+
+
+template<typename IMAGE_TYPE>
+typename itk::Image<double, IMAGE_TYPE::ImageDimension>::Pointer compute_bspline_coefficients(typename IMAGE_TYPE::Pointer image, unsigned int number_of_threads=0) {
+    // Returns the cubic bspline coefficients of image, which bspline interpolation samples instead of the image
+    typedef itk::BSplineDecompositionImageFilter<IMAGE_TYPE, itk::Image<double, IMAGE_TYPE::ImageDimension> > DecompositionFilterType;
+    typename DecompositionFilterType::Pointer decomposition_filter = DecompositionFilterType::New();
+    decomposition_filter->SetSplineOrder(3);
+    decomposition_filter->SetInput(image);
+    if (number_of_threads > 0) {
+        decomposition_filter->SetNumberOfThreads(number_of_threads);
+    }
+    decomposition_filter->Update();
+    return decomposition_filter->GetOutput();
+}
+
+
+// Holds the bspline coefficients of images, so that an image warped through several transforms is decomposed once
+// The coefficients of an image are computed again if it has been modified since. The cache keeps its images alive
+template<typename IMAGE_TYPE>
+class BSplineCoefficientCache {
+public:
+    typedef itk::Image<double, IMAGE_TYPE::ImageDimension> COEFFICIENT_IMAGE_TYPE;
+
+    typename COEFFICIENT_IMAGE_TYPE::Pointer get_coefficients(typename IMAGE_TYPE::Pointer image, unsigned int number_of_threads=0) {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        CacheEntry& entry = m_Entries[image.GetPointer()];
+        if (!entry.coefficients || entry.modified_time != image->GetMTime()) {
+            entry.image = image;
+            entry.modified_time = image->GetMTime();
+            entry.coefficients = compute_bspline_coefficients<IMAGE_TYPE>(image, number_of_threads);
+        }
+        return entry.coefficients;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Entries.clear();
+    }
+
+private:
+    struct CacheEntry {
+        typename IMAGE_TYPE::Pointer image;
+        itk::ModifiedTimeType modified_time;
+        typename COEFFICIENT_IMAGE_TYPE::Pointer coefficients;
+    };
+
+    std::map<const IMAGE_TYPE*, CacheEntry> m_Entries;
+    std::mutex m_Mutex;
+};
+
+
+template<typename INPUT_IMAGE_TYPE, typename OUTPUT_IMAGE_TYPE, typename TRANSFORM_TYPE>
+typename OUTPUT_IMAGE_TYPE::Pointer resample_onto_grid(
+    typename INPUT_IMAGE_TYPE::Pointer input,
+    typename OUTPUT_IMAGE_TYPE::Pointer grid_image,
+    typename TRANSFORM_TYPE::Pointer transform,
+    typename itk::InterpolateImageFunction<INPUT_IMAGE_TYPE, double>::Pointer interpolator,
+    unsigned int number_of_threads
+) {
+    // Samples input through transform, with interpolator, at every pixel of grid_image's grid
+    typedef itk::ResampleImageFilter<INPUT_IMAGE_TYPE, OUTPUT_IMAGE_TYPE> ImageResamplerType;
 
     typename ImageResamplerType::Pointer resampler = ImageResamplerType::New();
     resampler->SetTransform(transform);
-    resampler->SetInput(image);
+    resampler->SetInput(input);
+    resampler->SetInterpolator(interpolator);
 
-    // Configure the resampler to apply the BSpline Transform
-    resampler->SetSize(image->GetLargestPossibleRegion().GetSize());
-    resampler->SetOutputOrigin(image->GetOrigin());
-    resampler->SetOutputSpacing(image->GetSpacing());
-    resampler->SetOutputDirection(image->GetDirection());
+    resampler->SetSize(grid_image->GetLargestPossibleRegion().GetSize());
+    resampler->SetOutputStartIndex(grid_image->GetLargestPossibleRegion().GetIndex());
+    resampler->SetOutputOrigin(grid_image->GetOrigin());
+    resampler->SetOutputSpacing(grid_image->GetSpacing());
+    resampler->SetOutputDirection(grid_image->GetDirection());
     resampler->SetDefaultPixelValue(0);
-
-    // Link the interpolator to the resamplers
-    typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
-    resampler->SetInterpolator(interpolator);
+    if (number_of_threads > 0) {
+        resampler->SetNumberOfThreads(number_of_threads);
+    }
 
     resampler->Update();
     return resampler->GetOutput();
 }
 
+
+template<typename IMAGE_TYPE, typename TRANSFORM_TYPE>
+typename IMAGE_TYPE::Pointer apply_transform(
+    typename IMAGE_TYPE::Pointer image,
+    typename TRANSFORM_TYPE::Pointer transform,
+    unsigned int number_of_threads=0,
+    InterpolationMethod interpolation=INTERPOLATE_BSPLINE,
+    BSplineCoefficientCache<IMAGE_TYPE>* coefficient_cache=NULL
+) {
+    // Applys the transform to the image, with bspline interpolation unless another is given
+    // The output has the grid of the image. The resampler uses number_of_threads threads, or ITK's global default for 0
+    // Bspline interpolation samples the coefficients of image held by coefficient_cache, or computes them if there is none
+    typedef typename BSplineCoefficientCache<IMAGE_TYPE>::COEFFICIENT_IMAGE_TYPE CoefficientImageType;
+    typedef itk::BSplineResampleImageFunction<CoefficientImageType, double> BSplineInterpolatorType;
+    typedef itk::NearestNeighborInterpolateImageFunction<IMAGE_TYPE, double> NearestInterpolatorType;
+    typedef itk::LinearInterpolateImageFunction<IMAGE_TYPE, double> LinearInterpolatorType;
+    typedef itk::WindowedSincInterpolateImageFunction<IMAGE_TYPE, 3> SincInterpolatorType;
+
+    switch (interpolation) {
+        case INTERPOLATE_NEAREST:
+            return resample_onto_grid<IMAGE_TYPE, IMAGE_TYPE, TRANSFORM_TYPE>(image, image, transform, NearestInterpolatorType::New().GetPointer(), number_of_threads);
+        case INTERPOLATE_LINEAR:
+            return resample_onto_grid<IMAGE_TYPE, IMAGE_TYPE, TRANSFORM_TYPE>(image, image, transform, LinearInterpolatorType::New().GetPointer(), number_of_threads);
+        case INTERPOLATE_SINC:
+            return resample_onto_grid<IMAGE_TYPE, IMAGE_TYPE, TRANSFORM_TYPE>(image, image, transform, SincInterpolatorType::New().GetPointer(), number_of_threads);
+        default:
+            break;
+    }
+
+    // The bspline resample function takes its input as coefficients, instead of decomposing it again
+    typename CoefficientImageType::Pointer coefficients = coefficient_cache
+        ? coefficient_cache->get_coefficients(image, number_of_threads)
+        : compute_bspline_coefficients<IMAGE_TYPE>(image, number_of_threads);
+    return resample_onto_grid<CoefficientImageType, IMAGE_TYPE, TRANSFORM_TYPE>(
+        coefficients, image, transform, BSplineInterpolatorType::New().GetPointer(), number_of_threads);
+}
+
+
+// A displacement field holds, at each pixel of an output grid, the vector from that point to where a transform maps it
+// Warping through the field only interpolates the field, which is much cheaper than evaluating a B-spline transform
+template<typename IMAGE_TYPE>
+struct DisplacementFieldTypes {
+    typedef itk::Image<itk::Vector<double, IMAGE_TYPE::ImageDimension>, IMAGE_TYPE::ImageDimension> FIELD_TYPE;
+    typedef itk::DisplacementFieldTransform<double, IMAGE_TYPE::ImageDimension> FIELD_TRANSFORM_TYPE;
+};
+
+
+template<typename IMAGE_TYPE, typename TRANSFORM_TYPE>
+typename DisplacementFieldTypes<IMAGE_TYPE>::FIELD_TYPE::Pointer compute_displacement_field(typename IMAGE_TYPE::Pointer reference_image, typename TRANSFORM_TYPE::Pointer transform, unsigned int number_of_threads=0) {
+    // Evaluates transform once at every pixel of reference_image's grid
+    typedef typename DisplacementFieldTypes<IMAGE_TYPE>::FIELD_TYPE FIELD_TYPE;
+    typedef itk::TransformToDisplacementFieldFilter<FIELD_TYPE, double> FieldFilterType;
+
+    typename FieldFilterType::Pointer field_filter = FieldFilterType::New();
+    field_filter->SetTransform(transform);
+    field_filter->SetReferenceImage(reference_image);
+    field_filter->SetUseReferenceImage(true);
+    if (number_of_threads > 0) {
+        field_filter->SetNumberOfThreads(number_of_threads);
+    }
+    field_filter->Update();
+    return field_filter->GetOutput();
+}
+
+
+template<typename IMAGE_TYPE>
+typename DisplacementFieldTypes<IMAGE_TYPE>::FIELD_TRANSFORM_TYPE::Pointer create_field_transform(typename DisplacementFieldTypes<IMAGE_TYPE>::FIELD_TYPE::Pointer field) {
+    typedef typename DisplacementFieldTypes<IMAGE_TYPE>::FIELD_TRANSFORM_TYPE FIELD_TRANSFORM_TYPE;
+    typename FIELD_TRANSFORM_TYPE::Pointer field_transform = FIELD_TRANSFORM_TYPE::New();
+    field_transform->SetDisplacementField(field);
+    return field_transform;
+}
+
+
+template<typename FIRST_IMAGE_TYPE, typename SECOND_IMAGE_TYPE>
+bool images_share_grid(typename FIRST_IMAGE_TYPE::Pointer first_image, typename SECOND_IMAGE_TYPE::Pointer second_image) {
+    // Returns true if both images have the same region, and the same origin, spacing and direction up to rounding
+    // Geometry written to an image file can come back different in the last digits, so it is compared with the
+    //  tolerances ITK's filters use for their inputs: 1e-6 of the first spacing for coordinates, 1e-6 for directions
+    const unsigned int dimensions = FIRST_IMAGE_TYPE::ImageDimension;
+    const double coordinate_tolerance = 1e-6 * std::fabs(first_image->GetSpacing()[0]);
+    const double direction_tolerance = 1e-6;
+    if (first_image->GetLargestPossibleRegion() != second_image->GetLargestPossibleRegion()) {
+        return false;
+    }
+    for (unsigned int i = 0; i < dimensions; i++) {
+        if (std::fabs(first_image->GetOrigin()[i] - second_image->GetOrigin()[i]) > coordinate_tolerance
+                || std::fabs(first_image->GetSpacing()[i] - second_image->GetSpacing()[i]) > coordinate_tolerance) {
+            return false;
+        }
+        for (unsigned int j = 0; j < dimensions; j++) {
+            if (std::fabs(first_image->GetDirection()[i][j] - second_image->GetDirection()[i][j]) > direction_tolerance) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+template<typename IMAGE_TYPE, typename FIELD_TYPE>
+bool field_covers_grid(typename FIELD_TYPE::Pointer field, typename IMAGE_TYPE::Pointer image) {
+    // Returns true if field was computed on the grid apply_transform resamples image onto
+    // Points outside of a field are not displaced, so a field can only stand in for its transform on its own grid
+    return images_share_grid<FIELD_TYPE, IMAGE_TYPE>(field, image);
+}
+
+
+inline long mirror_index(long index, long length) {
+    // Reflects index into [0, length) about the image border, as the bspline interpolator does
+    if (length < 2) {
+        return 0;
+    }
+    const long period = 2 * length - 2;
+    index %= period;
+    if (index < 0) {
+        index += period;
+    }
+    return index < length ? index : period - index;
+}
+
+
+template<typename IMAGE_TYPE, typename TRANSFORM_TYPE>
+std::vector<typename IMAGE_TYPE::Pointer> apply_transform_to_channels(const std::vector<typename IMAGE_TYPE::Pointer>& channels, typename TRANSFORM_TYPE::Pointer transform, unsigned int number_of_threads=0, BSplineCoefficientCache<IMAGE_TYPE>* coefficient_cache=NULL) {
+    // Applys the transform to images that share one grid with bspline interpolation, as apply_transform does to each
+    // The transformed point and the interpolation weights are computed once per output pixel, and used for every channel
+    // The spline coefficients of the channels are interleaved, so the channels of each support point are read together.
+    //  They are taken from coefficient_cache when one is given
+    const unsigned int Dimension = IMAGE_TYPE::ImageDimension;
+    typedef itk::Image<double, Dimension> CoefficientImageType;
+    typedef itk::BSplineInterpolationWeightFunction<double, Dimension, 3> WeightFunctionType;
+    typedef typename IMAGE_TYPE::PixelType PixelType;
+
+    std::vector<typename IMAGE_TYPE::Pointer> outputs;
+    if (channels.empty()) {
+        return outputs;
+    }
+
+    typename IMAGE_TYPE::Pointer reference_image = channels[0];
+    const typename IMAGE_TYPE::RegionType region = reference_image->GetLargestPossibleRegion();
+    const size_t number_of_pixels = region.GetNumberOfPixels();
+    const size_t number_of_channels = channels.size();
+    if (number_of_threads == 0) {
+        number_of_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    // Compute the coefficients of each channel, and interleave them
+    std::vector<double> coefficients(number_of_pixels * number_of_channels);
+    for (size_t channel = 0; channel < number_of_channels; channel++) {
+        typename CoefficientImageType::Pointer coefficient_image = coefficient_cache
+            ? coefficient_cache->get_coefficients(channels[channel], number_of_threads)
+            : compute_bspline_coefficients<IMAGE_TYPE>(channels[channel], number_of_threads);
+        const double* channel_coefficients = coefficient_image->GetBufferPointer();
+        for (size_t i = 0; i < number_of_pixels; i++) {
+            coefficients[i * number_of_channels + channel] = channel_coefficients[i];
+        }
+    }
+
+    std::vector<PixelType*> output_buffers;
+    for (size_t channel = 0; channel < number_of_channels; channel++) {
+        typename IMAGE_TYPE::Pointer output = IMAGE_TYPE::New();
+        output->CopyInformation(reference_image);
+        output->SetRegions(region);
+        output->Allocate();
+        outputs.push_back(output);
+        output_buffers.push_back(output->GetBufferPointer());
+    }
+
+    // Offset of each weight's support point from the first, the first dimension varies fastest
+    typename WeightFunctionType::Pointer weight_function = WeightFunctionType::New();
+    const unsigned int support_size = WeightFunctionType::NumberOfWeights;
+    std::vector<itk::Offset<Dimension> > support_offsets(support_size);
+    for (unsigned int k = 0; k < support_size; k++) {
+        unsigned int remainder = k;
+        for (unsigned int d = 0; d < Dimension; d++) {
+            support_offsets[k][d] = remainder % 4;
+            remainder /= 4;
+        }
+    }
+
+    // Each thread warps a contiguous block of output pixels
+    auto warp_pixels = [&](size_t first_pixel, size_t last_pixel) {
+        typename WeightFunctionType::WeightsType weights(support_size);
+        typename WeightFunctionType::IndexType start_index;
+        std::vector<double> values(number_of_channels);
+        typename IMAGE_TYPE::PointType point;
+        itk::ContinuousIndex<double, Dimension> input_index;
+
+        for (size_t pixel = first_pixel; pixel < last_pixel; pixel++) {
+            reference_image->TransformIndexToPhysicalPoint(reference_image->ComputeIndex(pixel), point);
+            if (!reference_image->TransformPhysicalPointToContinuousIndex(transform->TransformPoint(point), input_index)) {
+                for (size_t channel = 0; channel < number_of_channels; channel++) {
+                    output_buffers[channel][pixel] = 0;
+                }
+                continue;
+            }
+
+            weight_function->Evaluate(input_index, weights, start_index);
+            std::fill(values.begin(), values.end(), 0.0);
+            for (unsigned int k = 0; k < support_size; k++) {
+                size_t offset = 0;
+                size_t stride = 1;
+                for (unsigned int d = 0; d < Dimension; d++) {
+                    offset += stride * mirror_index(start_index[d] + support_offsets[k][d] - region.GetIndex()[d], region.GetSize()[d]);
+                    stride *= region.GetSize()[d];
+                }
+                const double* support_coefficients = &coefficients[offset * number_of_channels];
+                for (size_t channel = 0; channel < number_of_channels; channel++) {
+                    values[channel] += weights[k] * support_coefficients[channel];
+                }
+            }
+            for (size_t channel = 0; channel < number_of_channels; channel++) {
+                output_buffers[channel][pixel] = static_cast<PixelType>(values[channel]);
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    const size_t pixels_per_thread = (number_of_pixels + number_of_threads - 1) / number_of_threads;
+    for (size_t first_pixel = 0; first_pixel < number_of_pixels; first_pixel += pixels_per_thread) {
+        workers.push_back(std::thread(warp_pixels, first_pixel, std::min(first_pixel + pixels_per_thread, number_of_pixels)));
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    return outputs;
+}
+
 #endif
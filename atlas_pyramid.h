@@ -0,0 +1,185 @@
+#ifndef ATLAS_PYRAMID
+#define ATLAS_PYRAMID
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "itkImage.h"
+#include "itkMetaImageIO.h"
+#include "itkMultiResolutionPyramidImageFilter.h"
+#include "itksys/MD5.h"
+#include "itksys/SystemTools.hxx"
+
+#include "image_io.h"
+
+// A pyramid of an atlas is stored next to it, in the directory <atlas_path>.pyramid
+// Level n of the pyramid is the atlas smoothed and shrunk by a factor of 2^n, in level_<n>.mha
+// The file "key" records the md5 sum of the atlas contents the pyramid was built from, along with the size
+//  and modification time of the atlas, so that a pyramid is never used for an atlas that has changed
+
+inline std::string get_pyramid_directory(const char* atlas_path) {
+    return std::string(atlas_path) + ".pyramid";
+}
+
+inline std::string get_pyramid_level_path(const char* atlas_path, const unsigned int level) {
+    std::ostringstream level_path;
+    level_path << get_pyramid_directory(atlas_path) << "/level_" << level << ".mha";
+    return level_path.str();
+}
+
+inline std::vector<std::string> get_atlas_files(const char* atlas_path) {
+    // Returns the files holding the atlas: the atlas itself, and the pixel data of a MetaImage header (.mhd)
+    std::vector<std::string> atlas_files(1, atlas_path);
+
+    itk::MetaImageIO::Pointer image_io = itk::MetaImageIO::New();
+    if (image_io->CanReadFile(atlas_path)) {
+        image_io->SetFileName(atlas_path);
+        image_io->ReadImageInformation();
+        std::string data_path = image_io->GetMetaImagePointer()->ElementDataFileName();
+        if (data_path != "LOCAL") {
+            if (!itksys::SystemTools::FileIsFullPath(data_path.c_str())) {
+                std::string header_directory = itksys::SystemTools::GetFilenamePath(atlas_path);
+                if (!header_directory.empty()) {
+                    data_path = header_directory + "/" + data_path;
+                }
+            }
+            atlas_files.push_back(data_path);
+        }
+    }
+    return atlas_files;
+}
+
+inline std::string compute_atlas_md5(const char* atlas_path) {
+    // Returns the md5 sum of the contents of every file holding the atlas
+    std::vector<std::string> atlas_files = get_atlas_files(atlas_path);
+    itksysMD5* md5 = itksysMD5_New();
+    itksysMD5_Initialize(md5);
+
+    std::vector<char> chunk(1 << 20);
+    for (size_t i = 0; i < atlas_files.size(); i++) {
+        std::ifstream atlas_file(atlas_files[i].c_str(), std::ios::in | std::ios::binary);
+        if (!atlas_file) {
+            itksysMD5_Delete(md5);
+            throw std::runtime_error("Could not read " + atlas_files[i]);
+        }
+        while (atlas_file.read(&chunk[0], chunk.size()) || atlas_file.gcount() > 0) {
+            itksysMD5_Append(md5, reinterpret_cast<unsigned char*>(&chunk[0]), atlas_file.gcount());
+        }
+    }
+
+    char digest[33];
+    itksysMD5_FinalizeHex(md5, digest);
+    itksysMD5_Delete(md5);
+    digest[32] = 0;
+    return std::string(digest);
+}
+
+inline std::string get_atlas_fingerprint(const char* atlas_path) {
+    // Returns the sizes and modification times of the files holding the atlas
+    // This is cheap to compute, and tells us when the md5 sum has to be checked again
+    std::vector<std::string> atlas_files = get_atlas_files(atlas_path);
+    std::ostringstream fingerprint;
+    for (size_t i = 0; i < atlas_files.size(); i++) {
+        fingerprint << itksys::SystemTools::FileLength(atlas_files[i].c_str()) << ":"
+                    << itksys::SystemTools::ModifiedTime(atlas_files[i].c_str()) << " ";
+    }
+    return fingerprint.str();
+}
+
+inline bool atlas_pyramid_is_current(const char* atlas_path, const unsigned int level) {
+    // Returns true if the pyramid next to atlas_path was built from the current atlas, and contains level
+    std::ifstream key_file((get_pyramid_directory(atlas_path) + "/key").c_str());
+    std::string md5;
+    std::string fingerprint;
+    unsigned int number_of_levels = 0;
+    if (!std::getline(key_file, md5) || !std::getline(key_file, fingerprint) || !(key_file >> number_of_levels)) {
+        return false;
+    }
+
+    if (level > number_of_levels || !itksys::SystemTools::FileExists(get_pyramid_level_path(atlas_path, level).c_str())) {
+        return false;
+    }
+
+    // Only rehash the atlas if it may have changed
+    const std::string current_fingerprint = get_atlas_fingerprint(atlas_path);
+    if (fingerprint == current_fingerprint) {
+        return true;
+    }
+    if (md5 != compute_atlas_md5(atlas_path)) {
+        return false;
+    }
+
+    // The atlas was copied or touched, but not changed. Record its new fingerprint so it is not hashed again
+    // The key is replaced in one rename, so no reader sees it half written. A key that cannot be written is left as it was
+    const std::string key_path = get_pyramid_directory(atlas_path) + "/key";
+    const std::string new_key_path = key_path + ".new";
+    {
+        std::ofstream new_key_file(new_key_path.c_str());
+        new_key_file << md5 << std::endl;
+        new_key_file << current_fingerprint << std::endl;
+        new_key_file << number_of_levels << std::endl;
+        if (!new_key_file) {
+            std::remove(new_key_path.c_str());
+            return true;
+        }
+    }
+    if (std::rename(new_key_path.c_str(), key_path.c_str()) != 0) {
+        std::remove(new_key_path.c_str());
+    }
+    return true;
+}
+
+template<typename ATLAS_IMAGE_TYPE>
+void build_atlas_pyramid(const char* atlas_path, const unsigned int number_of_levels) {
+    // Builds levels 1 to number_of_levels of the pyramid of the atlas at atlas_path
+    // Each level is smoothed with a gaussian before it is shrunk, to avoid aliasing
+    typedef itk::MultiResolutionPyramidImageFilter<ATLAS_IMAGE_TYPE, ATLAS_IMAGE_TYPE> PyramidFilterType;
+
+    typename ATLAS_IMAGE_TYPE::Pointer atlas = load_image<ATLAS_IMAGE_TYPE>(atlas_path);
+
+    // The pyramid filter orders levels from coarsest to finest, and includes the full resolution atlas
+    typename PyramidFilterType::Pointer pyramid_filter = PyramidFilterType::New();
+    pyramid_filter->SetInput(atlas);
+    pyramid_filter->SetNumberOfLevels(number_of_levels + 1);
+    pyramid_filter->SetStartingShrinkFactors(1 << number_of_levels);
+    pyramid_filter->Update();
+
+    itksys::SystemTools::MakeDirectory(get_pyramid_directory(atlas_path).c_str());
+    for (unsigned int level = 1; level <= number_of_levels; level++) {
+        write_image<ATLAS_IMAGE_TYPE>(pyramid_filter->GetOutput(number_of_levels - level),
+                                      get_pyramid_level_path(atlas_path, level).c_str());
+    }
+
+    // Write the key last, so that an interrupted build is never used
+    std::ofstream key_file((get_pyramid_directory(atlas_path) + "/key").c_str());
+    key_file << compute_atlas_md5(atlas_path) << std::endl;
+    key_file << get_atlas_fingerprint(atlas_path) << std::endl;
+    key_file << number_of_levels << std::endl;
+}
+
+template<typename ATLAS_IMAGE_TYPE>
+int get_pyramid_slice_index(
+    const typename ATLAS_IMAGE_TYPE::Pointer atlas_header,
+    const typename ATLAS_IMAGE_TYPE::Pointer level_header,
+    const int slice_index,
+    const int axis_to_collapse
+) {
+    // Returns the slice of a pyramid level nearest to slice_index of the full resolution atlas
+    // With the headers swapped, returns the full resolution slice nearest to slice_index of a level
+    typename ATLAS_IMAGE_TYPE::IndexType atlas_index = atlas_header->GetLargestPossibleRegion().GetIndex();
+    atlas_index[axis_to_collapse] = slice_index;
+
+    typename ATLAS_IMAGE_TYPE::PointType slice_point;
+    atlas_header->TransformIndexToPhysicalPoint(atlas_index, slice_point);
+
+    itk::ContinuousIndex<double, ATLAS_IMAGE_TYPE::ImageDimension> level_index;
+    level_header->TransformPhysicalPointToContinuousIndex(slice_point, level_index);
+    return static_cast<int>(floor(level_index[axis_to_collapse] + 0.5));
+}
+
+#endif
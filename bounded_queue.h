@@ -0,0 +1,103 @@
+#ifndef BOUNDED_QUEUE
+#define BOUNDED_QUEUE
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+// A first in, first out queue shared between producer and consumer threads
+// push blocks while the queue is full, so producers can never run more than capacity items ahead of consumers
+template<typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(const size_t capacity) : m_Capacity(capacity > 0 ? capacity : 1), m_Closed(false) {};
+
+    bool push(const T& item) {
+        // Waits for space in the queue and adds item to it
+        // Returns false without adding item if the queue was closed
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_NotFull.wait(lock, [this]() { return m_Closed || m_Items.size() < m_Capacity; });
+        if (m_Closed) {
+            return false;
+        }
+        m_Items.push_back(item);
+        m_NotEmpty.notify_one();
+        return true;
+    }
+
+    bool pop(T& item) {
+        // Waits for an item and moves it into item
+        // Returns false once the queue is closed and every item has been taken
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_NotEmpty.wait(lock, [this]() { return m_Closed || !m_Items.empty(); });
+        if (m_Items.empty()) {
+            return false;
+        }
+        item = m_Items.front();
+        m_Items.pop_front();
+        m_NotFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        // Stops accepting items, and wakes every waiting thread
+        // Items already in the queue can still be popped
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Closed = true;
+        m_NotFull.notify_all();
+        m_NotEmpty.notify_all();
+    }
+
+private:
+    const size_t m_Capacity;
+    bool m_Closed;
+    std::deque<T> m_Items;
+    std::mutex m_Mutex;
+    std::condition_variable m_NotFull;
+    std::condition_variable m_NotEmpty;
+};
+
+// An amount of some resource, such as bytes of memory or items in flight, shared between threads
+// acquire blocks until enough has been released. A request larger than the whole budget is granted once nothing
+//  else is held, so it cannot wait forever. A budget of 0 is unlimited
+class SharedBudget {
+public:
+    explicit SharedBudget(const size_t budget) : m_Budget(budget), m_Held(0), m_Closed(false) {};
+
+    bool acquire(const size_t amount) {
+        // Waits until amount fits in the budget and holds it
+        // Returns false without holding anything if the budget was closed
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_Released.wait(lock, [this, amount]() {
+            return m_Closed || m_Budget == 0 || m_Held == 0 || m_Held + amount <= m_Budget;
+        });
+        if (m_Closed) {
+            return false;
+        }
+        m_Held += amount;
+        return true;
+    }
+
+    void release(const size_t amount) {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Held -= amount < m_Held ? amount : m_Held;
+        m_Released.notify_all();
+    }
+
+    void close() {
+        // Wakes every waiting thread, and refuses further requests
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Closed = true;
+        m_Released.notify_all();
+    }
+
+private:
+    const size_t m_Budget;
+    size_t m_Held;
+    bool m_Closed;
+    std::mutex m_Mutex;
+    std::condition_variable m_Released;
+};
+
+#endif
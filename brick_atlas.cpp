@@ -0,0 +1,120 @@
+#include "bricked_atlas.h"
+#include "image_io.h"
+#include "optionparser.h"
+#include <iostream>
+
+#include "itkImage.h"
+
+using namespace std;
+
+// option parsing
+struct Arg: public option::Arg
+ {
+   static void printError(const char* msg1, const option::Option& opt, const char* msg2)
+   {
+     fprintf(stderr, "ERROR: %s", msg1);
+     fwrite(opt.name, opt.namelen, 1, stderr);
+     fprintf(stderr, "%s", msg2);
+   }
+
+   static option::ArgStatus Unknown(const option::Option& option, bool msg)
+   {
+     if (msg) printError("Unknown option '", option, "'\n");
+     return option::ARG_ILLEGAL;
+   }
+
+   static option::ArgStatus Required(const option::Option& option, bool msg)
+   {
+     if (option.arg != 0)
+       return option::ARG_OK;
+
+     if (msg) printError("Option '", option, "' requires an argument\n");
+     return option::ARG_ILLEGAL;
+   }
+
+   static option::ArgStatus Numeric(const option::Option& option, bool msg)
+   {
+     char* endptr = 0;
+     if (option.arg != 0 && strtol(option.arg, &endptr, 10)){};
+     if (endptr != option.arg && *endptr == 0)
+       return option::ARG_OK;
+
+     if (msg) printError("Option '", option, "' requires a numeric argument\n");
+     return option::ARG_ILLEGAL;
+   }
+ };
+
+
+enum optionIndex {
+    UNKNOWN,
+    HELP,
+    ATLAS_PATH,
+    OUTPUT_PATH,
+    BRICK_SIZE,
+    COMPRESS
+};
+
+
+const option::Descriptor usage[] = {
+    {UNKNOWN, 0, "", "", Arg::Unknown, "USAGE: brick_atlas [options]\n\n"
+                                       "Options: "},
+    {HELP, 0, "h", "help", Arg::None, "--help, -h \tDisplay this help message and exit"},
+    {ATLAS_PATH, 0, "a", "atlas", Arg::Required, "--atlas, -a path \tPath to the atlas to convert"},
+    {OUTPUT_PATH, 0, "o", "output", Arg::Required, "--output, -o path \tPath to save the bricked atlas, e.g. atlas.bricks"},
+    {BRICK_SIZE, 0, "b", "brick_size", Arg::Numeric, "--brick_size, -b int \tEdge length of the bricks in pixels\n"
+                                                     "Default: 32"},
+    {COMPRESS, 0, "c", "compress", Arg::None, "--compress, -c \tDeflate each brick with zlib"},
+    {0,0,0,0,0,0}
+};
+
+template<typename PixelType>
+void brick_atlas(const char* atlas_path, const char* output_path, const unsigned int brick_size, const bool compress) {
+    typedef itk::Image<PixelType, 3> AtlasImageType;
+    typename AtlasImageType::Pointer atlas = load_image<AtlasImageType>(atlas_path);
+    write_bricked_atlas<AtlasImageType>(atlas, output_path, brick_size, compress);
+}
+
+int main(int argc, char** argv) {
+    // Parse input
+    argv += (argc>0);
+    argc -= (argc>0);
+
+    option::Stats stats(usage, argc, argv);
+    option::Option* options = new option::Option[stats.options_max];
+    option::Option* buffer = new option::Option[stats.buffer_max];
+    option::Parser parse(usage, argc, argv, options, buffer);
+
+    if (options[HELP]) {
+        option::printUsage(cout, usage);
+        return 1;
+    }
+
+    if (!options[ATLAS_PATH] || !options[OUTPUT_PATH]) {
+        cout << "Insufficient arguments!!" << endl;
+        cout << "An atlas path and an output path must be specified" << endl << endl;
+        option::printUsage(cout, usage);
+        return 1;
+    }
+
+    const int brick_size = options[BRICK_SIZE] ? atoi(options[BRICK_SIZE].arg) : 32;
+    if (brick_size < 1) {
+        cerr << "The brick size must be positive" << endl;
+        return 1;
+    }
+
+    // Keep the pixel type of the atlas, so that label atlases keep their labels
+    switch (read_component_type(options[ATLAS_PATH].arg)) {
+        case itk::ImageIOBase::UCHAR:
+            brick_atlas<unsigned char>(options[ATLAS_PATH].arg, options[OUTPUT_PATH].arg, brick_size, options[COMPRESS]);
+            break;
+        case itk::ImageIOBase::USHORT:
+            brick_atlas<unsigned short>(options[ATLAS_PATH].arg, options[OUTPUT_PATH].arg, brick_size, options[COMPRESS]);
+            break;
+        case itk::ImageIOBase::UINT:
+            brick_atlas<unsigned int>(options[ATLAS_PATH].arg, options[OUTPUT_PATH].arg, brick_size, options[COMPRESS]);
+            break;
+        default:
+            brick_atlas<float>(options[ATLAS_PATH].arg, options[OUTPUT_PATH].arg, brick_size, options[COMPRESS]);
+    }
+    return 0;
+}
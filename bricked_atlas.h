@@ -0,0 +1,304 @@
+#ifndef BRICKED_ATLAS
+#define BRICKED_ATLAS
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "itkImage.h"
+#include "itkImageIOBase.h"
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itk_zlib.h"
+
+#include "image_io.h"
+
+// Bricked atlases store a 3D atlas as cubic bricks of brick_size^3 pixels, so that the pixels near each other
+//  on any axis are near each other in memory. A slice on any axis then reads only the bricks it crosses.
+//
+// File layout, in native byte order:
+//  char[8]     "ATLBRK1"
+//  uint32      pixel component type (itk::ImageIOBase::IOComponentType), pixel size, brick size, compressed (0 or 1)
+//  uint64[3]   size
+//  double[3]   spacing, double[3] origin, double[9] direction (row major)
+//  uint64[n]   offset of each brick in the file, uint64[n] stored length of each brick
+//  bricks      x fastest within a brick, bricks ordered x fastest. Edge bricks are padded with zeros.
+//              Each brick is deflated with zlib when the atlas is compressed
+
+const char BRICKED_ATLAS_MAGIC[8] = "ATLBRK1";
+
+struct BrickedAtlasHeader {
+    unsigned int component_type;
+    unsigned int pixel_size;
+    unsigned int brick_size;
+    unsigned int compressed;
+    unsigned long long size[3];
+    double spacing[3];
+    double origin[3];
+    double direction[9];
+};
+
+inline bool is_bricked_atlas(const char* atlas_path) {
+    // Returns true if the file at atlas_path starts with the bricked atlas magic
+    std::ifstream atlas_file(atlas_path, std::ios::in | std::ios::binary);
+    char magic[8];
+    return atlas_file.read(magic, sizeof(magic)) && memcmp(magic, BRICKED_ATLAS_MAGIC, sizeof(magic)) == 0;
+}
+
+inline itk::ImageIOBase::IOComponentType read_bricked_component_type(const char* atlas_path) {
+    // Returns the type the pixels of the bricked atlas at atlas_path are stored as
+    std::ifstream atlas_file(atlas_path, std::ios::in | std::ios::binary);
+    BrickedAtlasHeader header;
+    atlas_file.seekg(sizeof(BRICKED_ATLAS_MAGIC));
+    if (!atlas_file.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+        throw std::runtime_error(std::string(atlas_path) + " is not a bricked atlas");
+    }
+    return static_cast<itk::ImageIOBase::IOComponentType>(header.component_type);
+}
+
+inline unsigned long long get_number_of_bricks(const BrickedAtlasHeader& header, unsigned long long bricks_per_axis[3]) {
+    unsigned long long number_of_bricks = 1;
+    for (int i = 0; i < 3; i++) {
+        bricks_per_axis[i] = (header.size[i] + header.brick_size - 1) / header.brick_size;
+        number_of_bricks *= bricks_per_axis[i];
+    }
+    return number_of_bricks;
+}
+
+
+// An atlas read brick by brick from a bricked atlas file. Bricks are read when first requested, then kept in memory
+// GetBrick may be called from several threads at once
+template<typename TPixel>
+class BrickedAtlas : public itk::Object {
+public:
+    typedef BrickedAtlas Self;
+    typedef itk::Object Superclass;
+    typedef itk::SmartPointer<Self> Pointer;
+    typedef itk::SmartPointer<const Self> ConstPointer;
+    itkNewMacro(Self);
+    itkTypeMacro(BrickedAtlas, Object);
+
+    typedef TPixel PixelType;
+    typedef itk::Image<TPixel, 3> ImageType;
+
+    void Open(const char* atlas_path) {
+        // Reads the header and brick table of the bricked atlas at atlas_path
+        m_File.open(atlas_path, std::ios::in | std::ios::binary);
+        char magic[8];
+        if (!m_File.read(magic, sizeof(magic)) || memcmp(magic, BRICKED_ATLAS_MAGIC, sizeof(magic)) != 0) {
+            throw std::runtime_error(std::string(atlas_path) + " is not a bricked atlas");
+        }
+
+        if (!m_File.read(reinterpret_cast<char*>(&m_Header), sizeof(m_Header))) {
+            throw std::runtime_error(std::string(atlas_path) + " is truncated");
+        }
+        if (m_Header.brick_size == 0 || m_Header.size[0] == 0 || m_Header.size[1] == 0 || m_Header.size[2] == 0) {
+            throw std::runtime_error(std::string(atlas_path) + " has an empty size or brick size");
+        }
+        if (m_Header.component_type != itk::ImageIOBase::MapPixelType<TPixel>::CType || m_Header.pixel_size != sizeof(TPixel)) {
+            throw std::runtime_error(std::string(atlas_path) + " holds a different pixel type");
+        }
+
+        unsigned long long bricks_per_axis[3];
+        const unsigned long long number_of_bricks = get_number_of_bricks(m_Header, bricks_per_axis);
+
+        // Check the brick table fits in the file before allocating it, so a corrupt size cannot ask for any amount of memory
+        const std::streampos table_start = m_File.tellg();
+        m_File.seekg(0, std::ios::end);
+        const unsigned long long table_space = static_cast<unsigned long long>(m_File.tellg() - table_start);
+        m_File.seekg(table_start);
+        if (number_of_bricks > table_space / (2 * sizeof(unsigned long long))) {
+            throw std::runtime_error(std::string(atlas_path) + " is truncated");
+        }
+        m_BrickOffsets.resize(number_of_bricks);
+        m_BrickLengths.resize(number_of_bricks);
+        m_File.read(reinterpret_cast<char*>(&m_BrickOffsets[0]), number_of_bricks * sizeof(unsigned long long));
+        m_File.read(reinterpret_cast<char*>(&m_BrickLengths[0]), number_of_bricks * sizeof(unsigned long long));
+        if (!m_File) {
+            throw std::runtime_error(std::string(atlas_path) + " is truncated");
+        }
+        m_Bricks.assign(number_of_bricks, std::vector<TPixel>());
+
+        // Describe the atlas the way an itk::Image would
+        typename ImageType::SizeType size;
+        for (int i = 0; i < 3; i++) {
+            size[i] = m_Header.size[i];
+            m_Spacing[i] = m_Header.spacing[i];
+            m_Origin[i] = m_Header.origin[i];
+            m_BricksPerAxis[i] = bricks_per_axis[i];
+            for (int j = 0; j < 3; j++) {
+                m_Direction[i][j] = m_Header.direction[3 * i + j];
+            }
+        }
+        m_LargestPossibleRegion.SetSize(size);
+    }
+
+    const typename ImageType::RegionType& GetLargestPossibleRegion() const { return m_LargestPossibleRegion; }
+    const typename ImageType::SpacingType& GetSpacing() const { return m_Spacing; }
+    const typename ImageType::PointType& GetOrigin() const { return m_Origin; }
+    const typename ImageType::DirectionType& GetDirection() const { return m_Direction; }
+    unsigned int GetBrickSize() const { return m_Header.brick_size; }
+    unsigned long long GetBricksPerAxis(const int axis) const { return m_BricksPerAxis[axis]; }
+
+    const TPixel* GetBrick(const unsigned long long brick_x, const unsigned long long brick_y, const unsigned long long brick_z) {
+        // Returns the pixels of the brick at the given brick coordinates, reading it if needed
+        const unsigned long long brick_index = brick_x + m_BricksPerAxis[0] * (brick_y + m_BricksPerAxis[1] * brick_z);
+        const size_t pixels_per_brick = static_cast<size_t>(m_Header.brick_size) * m_Header.brick_size * m_Header.brick_size;
+
+        // An uncompressed brick is stored as it is, and a compressed one is never empty or larger than zlib's bound
+        const unsigned long long brick_bytes = pixels_per_brick * sizeof(TPixel);
+        const unsigned long long stored_length = m_BrickLengths[brick_index];
+        if (m_Header.compressed ? stored_length == 0 || stored_length > compressBound(brick_bytes) : stored_length != brick_bytes) {
+            throw std::runtime_error("A brick of the bricked atlas has the wrong stored length");
+        }
+
+        // Read the stored brick while holding the lock, but inflate it without
+        std::vector<char> stored_brick;
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            if (!m_Bricks[brick_index].empty()) {
+                return &m_Bricks[brick_index][0];
+            }
+            stored_brick.resize(m_BrickLengths[brick_index]);
+            m_File.clear();
+            m_File.seekg(m_BrickOffsets[brick_index]);
+            m_File.read(&stored_brick[0], stored_brick.size());
+            if (!m_File) {
+                throw std::runtime_error("Could not read a brick of the bricked atlas");
+            }
+        }
+
+        std::vector<TPixel> brick(pixels_per_brick);
+        if (m_Header.compressed) {
+            // A short or corrupt brick can inflate without error to fewer bytes than a brick holds
+            uLongf brick_length = brick_bytes;
+            if (uncompress(reinterpret_cast<Bytef*>(&brick[0]), &brick_length,
+                           reinterpret_cast<const Bytef*>(&stored_brick[0]), stored_brick.size()) != Z_OK
+                    || brick_length != brick_bytes) {
+                throw std::runtime_error("Could not inflate a brick of the bricked atlas");
+            }
+        } else {
+            memcpy(&brick[0], &stored_brick[0], brick_bytes);
+        }
+
+        // Another thread may have read the same brick in the meantime, keep the first
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (m_Bricks[brick_index].empty()) {
+            m_Bricks[brick_index].swap(brick);
+        }
+        return &m_Bricks[brick_index][0];
+    }
+
+protected:
+    BrickedAtlas() {};
+
+private:
+    BrickedAtlasHeader m_Header;
+    typename ImageType::RegionType m_LargestPossibleRegion;
+    typename ImageType::SpacingType m_Spacing;
+    typename ImageType::PointType m_Origin;
+    typename ImageType::DirectionType m_Direction;
+    unsigned long long m_BricksPerAxis[3];
+
+    std::ifstream m_File;
+    std::vector<unsigned long long> m_BrickOffsets;
+    std::vector<unsigned long long> m_BrickLengths;
+    std::vector<std::vector<TPixel> > m_Bricks;
+    std::mutex m_Mutex;
+};
+
+
+template<typename TPixel>
+typename BrickedAtlas<TPixel>::Pointer open_bricked_atlas(const char* atlas_path) {
+    typename BrickedAtlas<TPixel>::Pointer atlas = BrickedAtlas<TPixel>::New();
+    atlas->Open(atlas_path);
+    return atlas;
+}
+
+template<typename ATLAS_IMAGE_TYPE>
+void write_bricked_atlas(const typename ATLAS_IMAGE_TYPE::Pointer atlas, const char* atlas_path, const unsigned int brick_size=32, const bool compress=false) {
+    // Writes atlas to atlas_path as a bricked atlas, with bricks of brick_size^3 pixels, optionally deflated with zlib
+    typedef typename ATLAS_IMAGE_TYPE::PixelType PixelType;
+
+    BrickedAtlasHeader header;
+    header.component_type = itk::ImageIOBase::MapPixelType<PixelType>::CType;
+    header.pixel_size = sizeof(PixelType);
+    header.brick_size = brick_size;
+    header.compressed = compress;
+
+    typename ATLAS_IMAGE_TYPE::RegionType atlas_region = atlas->GetLargestPossibleRegion();
+    for (int i = 0; i < 3; i++) {
+        header.size[i] = atlas_region.GetSize()[i];
+        header.spacing[i] = atlas->GetSpacing()[i];
+        header.origin[i] = atlas->GetOrigin()[i];
+        for (int j = 0; j < 3; j++) {
+            header.direction[3 * i + j] = atlas->GetDirection()[i][j];
+        }
+    }
+
+    unsigned long long bricks_per_axis[3];
+    const unsigned long long number_of_bricks = get_number_of_bricks(header, bricks_per_axis);
+    std::vector<unsigned long long> brick_offsets(number_of_bricks);
+    std::vector<unsigned long long> brick_lengths(number_of_bricks);
+
+    std::ofstream atlas_file(atlas_path, std::ios::out | std::ios::binary | std::ios::trunc);
+    atlas_file.write(BRICKED_ATLAS_MAGIC, sizeof(BRICKED_ATLAS_MAGIC));
+    atlas_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    // Leave room for the brick table, it is filled in once the bricks are written
+    const std::streamoff brick_table_offset = atlas_file.tellp();
+    atlas_file.write(reinterpret_cast<const char*>(&brick_offsets[0]), number_of_bricks * sizeof(unsigned long long));
+    atlas_file.write(reinterpret_cast<const char*>(&brick_lengths[0]), number_of_bricks * sizeof(unsigned long long));
+
+    const size_t pixels_per_brick = static_cast<size_t>(brick_size) * brick_size * brick_size;
+    std::vector<PixelType> brick(pixels_per_brick);
+    std::vector<Bytef> compressed_brick(compressBound(pixels_per_brick * sizeof(PixelType)));
+
+    unsigned long long brick_index = 0;
+    for (unsigned long long bz = 0; bz < bricks_per_axis[2]; bz++) {
+        for (unsigned long long by = 0; by < bricks_per_axis[1]; by++) {
+            for (unsigned long long bx = 0; bx < bricks_per_axis[0]; bx++, brick_index++) {
+                // Copy the brick out of the atlas, padding past the edges with zeros
+                std::fill(brick.begin(), brick.end(), PixelType());
+                typename ATLAS_IMAGE_TYPE::IndexType pixel_index;
+                for (unsigned int z = 0; z < brick_size && bz * brick_size + z < header.size[2]; z++) {
+                    for (unsigned int y = 0; y < brick_size && by * brick_size + y < header.size[1]; y++) {
+                        pixel_index[0] = atlas_region.GetIndex()[0] + bx * brick_size;
+                        pixel_index[1] = atlas_region.GetIndex()[1] + by * brick_size + y;
+                        pixel_index[2] = atlas_region.GetIndex()[2] + bz * brick_size + z;
+                        const PixelType* row = atlas->GetBufferPointer() + atlas->ComputeOffset(pixel_index);
+                        const unsigned long long row_length = std::min<unsigned long long>(brick_size, header.size[0] - bx * brick_size);
+                        std::copy(row, row + row_length, brick.begin() + brick_size * (y + brick_size * z));
+                    }
+                }
+
+                brick_offsets[brick_index] = atlas_file.tellp();
+                if (compress) {
+                    uLongf compressed_length = compressed_brick.size();
+                    if (compress2(&compressed_brick[0], &compressed_length,
+                                  reinterpret_cast<const Bytef*>(&brick[0]), pixels_per_brick * sizeof(PixelType), Z_DEFAULT_COMPRESSION) != Z_OK) {
+                        throw std::runtime_error("Could not compress a brick of the bricked atlas");
+                    }
+                    atlas_file.write(reinterpret_cast<const char*>(&compressed_brick[0]), compressed_length);
+                    brick_lengths[brick_index] = compressed_length;
+                } else {
+                    atlas_file.write(reinterpret_cast<const char*>(&brick[0]), pixels_per_brick * sizeof(PixelType));
+                    brick_lengths[brick_index] = pixels_per_brick * sizeof(PixelType);
+                }
+            }
+        }
+    }
+
+    atlas_file.seekp(brick_table_offset);
+    atlas_file.write(reinterpret_cast<const char*>(&brick_offsets[0]), number_of_bricks * sizeof(unsigned long long));
+    atlas_file.write(reinterpret_cast<const char*>(&brick_lengths[0]), number_of_bricks * sizeof(unsigned long long));
+    if (!atlas_file) {
+        throw std::runtime_error(std::string("Could not write ") + atlas_path);
+    }
+}
+
+#endif
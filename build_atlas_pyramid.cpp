@@ -0,0 +1,98 @@
+#include "atlas_pyramid.h"
+#include "optionparser.h"
+#include <iostream>
+
+#include "itkImage.h"
+
+using namespace std;
+
+// option parsing
+struct Arg: public option::Arg
+ {
+   static void printError(const char* msg1, const option::Option& opt, const char* msg2)
+   {
+     fprintf(stderr, "ERROR: %s", msg1);
+     fwrite(opt.name, opt.namelen, 1, stderr);
+     fprintf(stderr, "%s", msg2);
+   }
+
+   static option::ArgStatus Unknown(const option::Option& option, bool msg)
+   {
+     if (msg) printError("Unknown option '", option, "'\n");
+     return option::ARG_ILLEGAL;
+   }
+
+   static option::ArgStatus Required(const option::Option& option, bool msg)
+   {
+     if (option.arg != 0)
+       return option::ARG_OK;
+
+     if (msg) printError("Option '", option, "' requires an argument\n");
+     return option::ARG_ILLEGAL;
+   }
+
+   static option::ArgStatus Numeric(const option::Option& option, bool msg)
+   {
+     char* endptr = 0;
+     if (option.arg != 0 && strtol(option.arg, &endptr, 10)){};
+     if (endptr != option.arg && *endptr == 0)
+       return option::ARG_OK;
+
+     if (msg) printError("Option '", option, "' requires a numeric argument\n");
+     return option::ARG_ILLEGAL;
+   }
+ };
+
+
+enum optionIndex {
+    UNKNOWN,
+    HELP,
+    ATLAS_PATH,
+    NUMBER_OF_LEVELS
+};
+
+
+const option::Descriptor usage[] = {
+    {UNKNOWN, 0, "", "", Arg::Unknown, "USAGE: build_atlas_pyramid [options]\n\n"
+                                       "Options: "},
+    {HELP, 0, "h", "help", Arg::None, "--help, -h \tDisplay this help message and exit"},
+    {ATLAS_PATH, 0, "a", "atlas", Arg::Required, "--atlas, -a path \tPath to the atlas to build a pyramid for\n"
+                                                 "The pyramid is written to the directory <path>.pyramid"},
+    {NUMBER_OF_LEVELS, 0, "n", "levels", Arg::Numeric, "--levels, -n int \tNumber of levels below full resolution, "
+                                                       "each half the size of the one above\n"
+                                                       "Default: 3"},
+    {0,0,0,0,0,0}
+};
+
+int main(int argc, char** argv) {
+    // Parse input
+    argv += (argc>0);
+    argc -= (argc>0);
+
+    option::Stats stats(usage, argc, argv);
+    option::Option* options = new option::Option[stats.options_max];
+    option::Option* buffer = new option::Option[stats.buffer_max];
+    option::Parser parse(usage, argc, argv, options, buffer);
+
+    if (options[HELP]) {
+        option::printUsage(cout, usage);
+        return 1;
+    }
+
+    if (!options[ATLAS_PATH]) {
+        cout << "Insufficient arguments!!" << endl;
+        cout << "An atlas path must be specified" << endl << endl;
+        option::printUsage(cout, usage);
+        return 1;
+    }
+
+    const int number_of_levels = options[NUMBER_OF_LEVELS] ? atoi(options[NUMBER_OF_LEVELS].arg) : 3;
+    if (number_of_levels < 1) {
+        cerr << "The pyramid needs at least one level" << endl;
+        return 1;
+    }
+
+    typedef itk::Image<float, 3> AtlasImageType;
+    build_atlas_pyramid<AtlasImageType>(options[ATLAS_PATH].arg, number_of_levels);
+    return 0;
+}
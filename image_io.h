@@ -3,10 +3,14 @@
 
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
+#include "itkImageIOFactory.h"
 #include "itkTransformFileWriter.h"
 #include "itkTransformFileReader.h"
 #include "itkTransformFactoryBase.h"
 
+#include <stdexcept>
+#include <string>
+
 template<typename IMAGE_TYPE>
 typename IMAGE_TYPE::Pointer load_image(const char* image_path) {
     // Reads an image from image_path into an itk image of type IMAGE_TYPE
@@ -18,6 +22,71 @@ typename IMAGE_TYPE::Pointer load_image(const char* image_path) {
     return image_reader->GetOutput();
 }
 
+inline itk::ImageIOBase::IOComponentType read_component_type(const char* image_path) {
+    // Reads only the header of the image at image_path, and returns the type its pixels are stored as
+    itk::ImageIOBase::Pointer image_io = itk::ImageIOFactory::CreateImageIO(image_path, itk::ImageIOFactory::ReadMode);
+    if (!image_io) {
+        throw std::runtime_error(std::string("Could not find a reader for ") + image_path);
+    }
+    image_io->SetFileName(image_path);
+    image_io->ReadImageInformation();
+    return image_io->GetComponentType();
+}
+
+inline unsigned int read_image_dimension(const char* image_path) {
+    // Reads only the header of the image at image_path, and returns its number of dimensions
+    itk::ImageIOBase::Pointer image_io = itk::ImageIOFactory::CreateImageIO(image_path, itk::ImageIOFactory::ReadMode);
+    if (!image_io) {
+        throw std::runtime_error(std::string("Could not find a reader for ") + image_path);
+    }
+    image_io->SetFileName(image_path);
+    image_io->ReadImageInformation();
+    return image_io->GetNumberOfDimensions();
+}
+
+template<typename IMAGE_TYPE>
+typename IMAGE_TYPE::Pointer read_image_header(const char* image_path) {
+    // Reads only the header of the image at image_path
+    // The returned image has the size, spacing, origin and direction of the image, but no pixels
+    typedef itk::ImageFileReader<IMAGE_TYPE> ImageReaderType;
+    typename ImageReaderType::Pointer image_reader = ImageReaderType::New();
+
+    image_reader->SetFileName(image_path);
+    image_reader->UpdateOutputInformation();
+    return image_reader->GetOutput();
+}
+
+template<typename IMAGE_TYPE>
+typename IMAGE_TYPE::RegionType read_image_region(const char* image_path) {
+    // Reads only the header of the image at image_path, and returns its largest possible region
+    return read_image_header<IMAGE_TYPE>(image_path)->GetLargestPossibleRegion();
+}
+
+template<typename IMAGE_TYPE>
+typename IMAGE_TYPE::Pointer load_image_region(const char* image_path, const typename IMAGE_TYPE::RegionType& region) {
+    // Reads the region of the image at image_path into an itk image of type IMAGE_TYPE
+    // Formats that support streaming (MetaImage, NRRD, raw) read only the requested region from disk,
+    //  other formats fall back to reading the entire image
+    typedef itk::ImageFileReader<IMAGE_TYPE> ImageReaderType;
+    typename ImageReaderType::Pointer image_reader = ImageReaderType::New();
+
+    image_reader->SetFileName(image_path);
+    image_reader->UpdateOutputInformation();
+    image_reader->GetOutput()->SetRequestedRegion(region);
+    image_reader->GetOutput()->Update();
+    return image_reader->GetOutput();
+}
+
+template<typename IMAGE_TYPE>
+typename IMAGE_TYPE::Pointer graft_image(const typename IMAGE_TYPE::Pointer image) {
+    // Returns a new image that shares the pixels and geometry of image, but not its pipeline
+    // Filters update the requested region of their input, so filters running on different threads
+    //  each need their own view of a shared image. image should already be disconnected from its reader
+    typename IMAGE_TYPE::Pointer view = IMAGE_TYPE::New();
+    view->Graft(image);
+    return view;
+}
+
 template<typename IMAGE_TYPE>
 void write_image(const typename IMAGE_TYPE::Pointer input_image, const char* image_path) {
     // Writes an itk image of type IMAGE_TYPE to the location specified in image_path
@@ -40,7 +109,12 @@ typename TRANSFORM_TYPE::Pointer read_transform(const char* transform_path) {
     transform_reader->SetFileName(transform_path);
     transform_reader->Update();
 
-    return static_cast<TRANSFORM_TYPE*>(transform_reader->GetTransformList()->begin()->GetPointer());
+    // A transform of another type or dimension, e.g. a 2d transform applied to a volume, is rejected
+    TRANSFORM_TYPE* transform = dynamic_cast<TRANSFORM_TYPE*>(transform_reader->GetTransformList()->begin()->GetPointer());
+    if (!transform) {
+        throw std::runtime_error(std::string(transform_path) + " does not hold a " + TRANSFORM_TYPE::New()->GetTransformTypeAsString());
+    }
+    return transform;
 }
 
 template<typename TRANSFORM_TYPE>
@@ -0,0 +1,180 @@
+#ifndef IMAGE_MAPPING
+#define IMAGE_MAPPING
+
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "itkImage.h"
+#include "itkImportImageContainer.h"
+#include "itkMetaImageIO.h"
+#include "itkByteSwapper.h"
+#include "itksys/SystemTools.hxx"
+
+#include "image_io.h"
+
+// A pixel container that aliases a memory mapped file, and unmaps it when the last image using it is released
+template<typename TElementIdentifier, typename TElement>
+class MappedImageContainer : public itk::ImportImageContainer<TElementIdentifier, TElement> {
+public:
+    typedef MappedImageContainer Self;
+    typedef itk::ImportImageContainer<TElementIdentifier, TElement> Superclass;
+    typedef itk::SmartPointer<Self> Pointer;
+    typedef itk::SmartPointer<const Self> ConstPointer;
+    itkNewMacro(Self);
+    itkTypeMacro(MappedImageContainer, ImportImageContainer);
+
+    void SetMapping(void* mapping, size_t mapping_length, TElement* data, TElementIdentifier number_of_elements) {
+        // data points into mapping, and must stay valid until mapping is unmapped
+        m_Mapping = mapping;
+        m_MappingLength = mapping_length;
+        this->SetImportPointer(data, number_of_elements, false);
+    }
+
+protected:
+    MappedImageContainer() : m_Mapping(NULL), m_MappingLength(0) {};
+
+    ~MappedImageContainer() {
+        if (m_Mapping) {
+            munmap(m_Mapping, m_MappingLength);
+        }
+    }
+
+private:
+    void* m_Mapping;
+    size_t m_MappingLength;
+};
+
+
+inline std::streamoff find_local_data_offset(const char* header_path) {
+    // Returns the offset of the first byte after the ElementDataFile line of a MetaImage header
+    // For ElementDataFile = LOCAL this is where the pixel data begins
+    std::ifstream header(header_path, std::ios::in | std::ios::binary);
+    std::string line;
+    while (std::getline(header, line)) {
+        if (line.compare(0, 15, "ElementDataFile") == 0) {
+            return header.tellg();
+        }
+    }
+    return -1;
+}
+
+
+template<typename IMAGE_TYPE>
+typename IMAGE_TYPE::Pointer map_image(const char* image_path) {
+    // Memory maps the pixel data of the uncompressed MetaImage (.mha/.mhd) at image_path into an itk image of type IMAGE_TYPE
+    // The pixels are not copied, they are paged in from the page cache on first access and shared between processes.
+    // The mapping is private, so writing to the image never modifies the file.
+    // Images that cannot be mapped (other formats, compressed data, or a different pixel type) are read with load_image
+    typedef typename IMAGE_TYPE::PixelType PixelType;
+    typedef typename IMAGE_TYPE::PixelContainer::ElementIdentifier ElementIdentifier;
+    typedef MappedImageContainer<ElementIdentifier, PixelType> ContainerType;
+    const unsigned int dimensions = IMAGE_TYPE::ImageDimension;
+
+    // Read the header
+    itk::MetaImageIO::Pointer image_io = itk::MetaImageIO::New();
+    if (!image_io->CanReadFile(image_path)) {
+        return load_image<IMAGE_TYPE>(image_path);
+    }
+    image_io->SetFileName(image_path);
+    image_io->ReadImageInformation();
+    MetaImage* meta_image = image_io->GetMetaImagePointer();
+
+    const bool system_is_big_endian = itk::ByteSwapper<int>::SystemIsBigEndian();
+    const bool data_is_big_endian = image_io->GetByteOrder() == itk::ImageIOBase::BigEndian;
+    if (image_io->GetNumberOfDimensions() != dimensions
+            || image_io->GetNumberOfComponents() != 1
+            || image_io->GetComponentType() != itk::ImageIOBase::MapPixelType<PixelType>::CType
+            || meta_image->CompressedData()
+            || data_is_big_endian != system_is_big_endian) {
+        std::cerr << "Cannot memory map " << image_path << ", reading it instead" << std::endl;
+        return load_image<IMAGE_TYPE>(image_path);
+    }
+
+    // Set up the geometry of the image
+    typename IMAGE_TYPE::Pointer image = IMAGE_TYPE::New();
+    typename IMAGE_TYPE::SizeType size;
+    typename IMAGE_TYPE::SpacingType spacing;
+    typename IMAGE_TYPE::PointType origin;
+    typename IMAGE_TYPE::DirectionType direction;
+    for (unsigned int i = 0; i < dimensions; i++) {
+        size[i] = image_io->GetDimensions(i);
+        spacing[i] = image_io->GetSpacing(i);
+        origin[i] = image_io->GetOrigin(i);
+        for (unsigned int j = 0; j < dimensions; j++) {
+            direction[j][i] = image_io->GetDirection(i)[j];
+        }
+    }
+
+    typename IMAGE_TYPE::RegionType region;
+    region.SetSize(size);
+    image->SetRegions(region);
+    image->SetSpacing(spacing);
+    image->SetOrigin(origin);
+    image->SetDirection(direction);
+
+    // Locate the pixel data
+    const ElementIdentifier number_of_pixels = region.GetNumberOfPixels();
+    const std::streamoff data_length = number_of_pixels * sizeof(PixelType);
+    std::string data_path = meta_image->ElementDataFileName();
+    std::streamoff data_offset = 0;
+    if (data_path == "LOCAL") {
+        data_path = image_path;
+        data_offset = find_local_data_offset(image_path);
+    } else if (!itksys::SystemTools::FileIsFullPath(data_path.c_str())) {
+        std::string header_directory = itksys::SystemTools::GetFilenamePath(image_path);
+        if (!header_directory.empty()) {
+            data_path = header_directory + "/" + data_path;
+        }
+    }
+
+    int file_descriptor = open(data_path.c_str(), O_RDONLY);
+    struct stat file_status;
+    if (file_descriptor < 0 || fstat(file_descriptor, &file_status) != 0) {
+        if (file_descriptor >= 0) {
+            close(file_descriptor);
+        }
+        std::cerr << "Cannot open " << data_path << " for memory mapping, reading " << image_path << " instead" << std::endl;
+        return load_image<IMAGE_TYPE>(image_path);
+    }
+
+    // A header size of -1 means the pixel data is at the end of the data file
+    if (meta_image->HeaderSize() == -1) {
+        data_offset = file_status.st_size - data_length;
+    } else {
+        data_offset += meta_image->HeaderSize();
+    }
+
+    if (data_offset < 0 || data_offset % sizeof(PixelType) != 0 || data_offset + data_length > file_status.st_size) {
+        close(file_descriptor);
+        std::cerr << "Cannot memory map the pixel data of " << image_path << ", reading it instead" << std::endl;
+        return load_image<IMAGE_TYPE>(image_path);
+    }
+
+    // Map the file from the page containing the first pixel
+    const std::streamoff page_size = sysconf(_SC_PAGESIZE);
+    const std::streamoff mapping_offset = data_offset - data_offset % page_size;
+    const size_t mapping_length = data_length + (data_offset - mapping_offset);
+    void* mapping = mmap(NULL, mapping_length, PROT_READ | PROT_WRITE, MAP_PRIVATE, file_descriptor, mapping_offset);
+    close(file_descriptor);  // The mapping keeps the file open
+
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Memory mapping " << data_path << " failed, reading " << image_path << " instead" << std::endl;
+        return load_image<IMAGE_TYPE>(image_path);
+    }
+
+    // Wrap the mapping in a pixel container without copying
+    PixelType* pixels = reinterpret_cast<PixelType*>(static_cast<char*>(mapping) + (data_offset - mapping_offset));
+    typename ContainerType::Pointer container = ContainerType::New();
+    container->SetMapping(mapping, mapping_length, pixels, number_of_pixels);
+    image->SetPixelContainer(container);
+
+    return image;
+}
+
+#endif
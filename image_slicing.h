@@ -2,9 +2,45 @@
 #define IMAGE_SLICING
 
 #include "itkImage.h"
+#include "itkImportImageContainer.h"
 #include "itkExtractImageFilter.h"
+#include "itkResampleImageFilter.h"
+#include "itkIdentityTransform.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "itkNearestNeighborInterpolateImageFunction.h"
+#include "itkMatrix.h"
+#include "itkVector.h"
+
+#include <algorithm>
+#include <cmath>
 
 #include "image_io.h"
+#include "bricked_atlas.h"
+
+
+// A pixel container that aliases part of another image's buffer, and keeps that buffer alive
+template<typename TElementIdentifier, typename TElement>
+class AliasedImageContainer : public itk::ImportImageContainer<TElementIdentifier, TElement> {
+public:
+    typedef AliasedImageContainer Self;
+    typedef itk::ImportImageContainer<TElementIdentifier, TElement> Superclass;
+    typedef itk::SmartPointer<Self> Pointer;
+    typedef itk::SmartPointer<const Self> ConstPointer;
+    itkNewMacro(Self);
+    itkTypeMacro(AliasedImageContainer, ImportImageContainer);
+
+    void SetAlias(const itk::Object* owner, TElement* data, TElementIdentifier number_of_elements) {
+        // data points into memory held by owner
+        m_Owner = owner;
+        this->SetImportPointer(data, number_of_elements, false);
+    }
+
+protected:
+    AliasedImageContainer() {};
+
+private:
+    itk::Object::ConstPointer m_Owner;
+};
 
 
 template<typename IMAGE_TYPE>
@@ -13,8 +49,16 @@ typename IMAGE_TYPE::Pointer extract_image_slice(
     const int slice_index,
     const int axis_to_collapse
 ) {
+    // Returns the slice at slice_index on axis_to_collapse of image_to_slice
+    // Slices on the last axis are contiguous in memory, so the returned image aliases the buffer of image_to_slice
+    //  instead of copying it. Writing to such a slice writes to image_to_slice.
+    // Slices on other axes are gathered directly from the buffer of image_to_slice
     typedef itk::Image<typename IMAGE_TYPE::PixelType, IMAGE_TYPE::ImageDimension + 1> SlicedImageType;
     typedef itk::ExtractImageFilter<SlicedImageType, IMAGE_TYPE> SliceImageFilterType;
+    typedef typename IMAGE_TYPE::PixelType PixelType;
+    typedef typename IMAGE_TYPE::PixelContainer::ElementIdentifier ElementIdentifier;
+    typedef AliasedImageContainer<ElementIdentifier, PixelType> AliasedContainerType;
+    const int slice_dimensions = IMAGE_TYPE::ImageDimension;
 
     // Determine Slice Size
     typename SlicedImageType::RegionType entire_atlas_region = image_to_slice->GetLargestPossibleRegion();
@@ -30,15 +74,282 @@ typename IMAGE_TYPE::Pointer extract_image_slice(
     // Initialize a slice region
     typename SlicedImageType::RegionType slice_region(slice_start_index, slice_size);
 
-    // Extract the slice
-    typename SliceImageFilterType::Pointer extraction_filter = SliceImageFilterType::New();
-    extraction_filter->SetInput(image_to_slice);
-    extraction_filter->SetDirectionCollapseToIdentity();
+    // The slice can only be read from the buffer directly if it has already been loaded
+    typename SlicedImageType::SizeType buffered_slice_size = slice_size;
+    buffered_slice_size[axis_to_collapse] = 1;
+    typename SlicedImageType::RegionType buffered_slice_region(slice_start_index, buffered_slice_size);
+
+    if (!image_to_slice->GetBufferedRegion().IsInside(buffered_slice_region)) {
+        // Extract the slice
+        typename SliceImageFilterType::Pointer extraction_filter = SliceImageFilterType::New();
+        extraction_filter->SetInput(image_to_slice);
+        extraction_filter->SetDirectionCollapseToIdentity();
+
+        extraction_filter->SetExtractionRegion(slice_region);
+        extraction_filter->Update();
+        return extraction_filter->GetOutput();
+    }
+
+    // Describe the slice the same way the ExtractImageFilter does, dropping the collapsed axis
+    //  and collapsing the direction to identity
+    int input_axes[slice_dimensions];
+    typename IMAGE_TYPE::IndexType output_index;
+    typename IMAGE_TYPE::SizeType output_size;
+    typename IMAGE_TYPE::SpacingType output_spacing;
+    typename IMAGE_TYPE::PointType output_origin;
+    for (int i = 0, j = 0; i < slice_dimensions + 1; i++) {
+        if (i == axis_to_collapse) {
+            continue;
+        }
+        input_axes[j] = i;
+        output_index[j] = slice_start_index[i];
+        output_size[j] = slice_size[i];
+        output_spacing[j] = image_to_slice->GetSpacing()[i];
+        output_origin[j] = image_to_slice->GetOrigin()[i];
+        j++;
+    }
+
+    typename IMAGE_TYPE::Pointer slice = IMAGE_TYPE::New();
+    slice->SetRegions(typename IMAGE_TYPE::RegionType(output_index, output_size));
+    slice->SetSpacing(output_spacing);
+    slice->SetOrigin(output_origin);
+
+    const ElementIdentifier number_of_pixels = slice->GetLargestPossibleRegion().GetNumberOfPixels();
+    PixelType* slice_start = image_to_slice->GetBufferPointer() + image_to_slice->ComputeOffset(slice_start_index);
+
+    if (axis_to_collapse == slice_dimensions) {
+        // The slice is one contiguous block of the buffer
+        typename AliasedContainerType::Pointer container = AliasedContainerType::New();
+        container->SetAlias(image_to_slice->GetPixelContainer(), slice_start, number_of_pixels);
+        slice->SetPixelContainer(container);
+        return slice;
+    }
+
+    // Gather the slice one output row at a time. Rows are contiguous in the buffer unless axis 0 is collapsed
+    slice->Allocate();
+    const typename SlicedImageType::OffsetValueType* input_strides = image_to_slice->GetOffsetTable();
+    const typename SlicedImageType::OffsetValueType row_stride = input_strides[input_axes[0]];
+    const ElementIdentifier row_length = output_size[0];
+    const ElementIdentifier number_of_rows = number_of_pixels / row_length;
+    PixelType* output = slice->GetBufferPointer();
+
+    for (ElementIdentifier row = 0; row < number_of_rows; row++) {
+        // Find the start of the row in the buffer
+        const PixelType* input = slice_start;
+        ElementIdentifier remaining_rows = row;
+        for (int j = 1; j < slice_dimensions; j++) {
+            input += (remaining_rows % output_size[j]) * input_strides[input_axes[j]];
+            remaining_rows /= output_size[j];
+        }
+
+        if (row_stride == 1) {
+            output = std::copy(input, input + row_length, output);
+        } else {
+            for (ElementIdentifier i = 0; i < row_length; i++, input += row_stride) {
+                *output++ = *input;
+            }
+        }
+    }
+
+    return slice;
+}
+
+template<typename IMAGE_TYPE>
+typename IMAGE_TYPE::RegionType get_slab_region(
+    const typename IMAGE_TYPE::RegionType& image_region,
+    const int first_slice_index,
+    const int last_slice_index,
+    const int axis_to_collapse
+) {
+    // Returns the region of image_region between first_slice_index and last_slice_index (inclusive)
+    //  on axis_to_collapse. This is the only part of an image that extract_image_slice needs for those slices
+    typename IMAGE_TYPE::RegionType slab_region = image_region;
+    slab_region.SetIndex(axis_to_collapse, first_slice_index);
+    slab_region.SetSize(axis_to_collapse, last_slice_index - first_slice_index + 1);
+    return slab_region;
+}
+typedef itk::Matrix<double, 3, 3> PLANE_ROTATION_TYPE;
+
+inline PLANE_ROTATION_TYPE get_axis_rotation(const int rotation_axis, const double angle) {
+    // Returns the rotation by angle (radians) around the image axis rotation_axis
+    const int a = (rotation_axis + 1) % 3;
+    const int b = (rotation_axis + 2) % 3;
+
+    PLANE_ROTATION_TYPE rotation;
+    rotation.SetIdentity();
+    rotation[a][a] = cos(angle);
+    rotation[a][b] = -sin(angle);
+    rotation[b][a] = sin(angle);
+    rotation[b][b] = cos(angle);
+    return rotation;
+}
+
+inline PLANE_ROTATION_TYPE get_tilt_rotation(const int axis_to_collapse, const double pitch, const double yaw) {
+    // Returns the rotation that tilts a slice perpendicular to axis_to_collapse by pitch and yaw (degrees)
+    // Pitch rotates around the first remaining image axis, and yaw around the second
+    const double degrees_to_radians = M_PI / 180.0;
+    return get_axis_rotation((axis_to_collapse + 1) % 3, pitch * degrees_to_radians)
+        * get_axis_rotation((axis_to_collapse + 2) % 3, yaw * degrees_to_radians);
+}
+
+inline PLANE_ROTATION_TYPE get_normal_rotation(const int axis_to_collapse, itk::Vector<double, 3> normal) {
+    // Returns the rotation that turns axis_to_collapse onto normal, which is given in image axis order
+    // Uses Rodrigues' formula, with the rotation axis perpendicular to both vectors
+    normal.Normalize();
+    itk::Vector<double, 3> axis_vector;
+    axis_vector.Fill(0.0);
+    axis_vector[axis_to_collapse] = 1.0;
 
-    extraction_filter->SetExtractionRegion(slice_region);
-    extraction_filter->Update();
-    return extraction_filter->GetOutput();
+    const itk::Vector<double, 3> cross = itk::CrossProduct(axis_vector, normal);
+    const double sine = cross.GetNorm();
+    const double cosine = axis_vector * normal;
+
+    if (sine < 1e-12) {
+        // The normal is (anti)parallel to the axis, flip the slice over if needed
+        return cosine > 0 ? get_axis_rotation(axis_to_collapse, 0.0) : get_axis_rotation((axis_to_collapse + 1) % 3, M_PI);
+    }
+
+    PLANE_ROTATION_TYPE cross_matrix;
+    cross_matrix.Fill(0.0);
+    cross_matrix[0][1] = -cross[2];
+    cross_matrix[0][2] = cross[1];
+    cross_matrix[1][0] = cross[2];
+    cross_matrix[1][2] = -cross[0];
+    cross_matrix[2][0] = -cross[1];
+    cross_matrix[2][1] = cross[0];
+
+    PLANE_ROTATION_TYPE second_order_term = cross_matrix * cross_matrix;
+    second_order_term *= (1.0 - cosine) / (sine * sine);
+
+    PLANE_ROTATION_TYPE rotation;
+    rotation.SetIdentity();
+    rotation += cross_matrix;
+    rotation += second_order_term;
+    return rotation;
+}
+
+template<typename IMAGE_TYPE>
+typename IMAGE_TYPE::Pointer extract_oblique_slice(
+    const typename itk::Image<typename IMAGE_TYPE::PixelType, 3>::Pointer image_to_slice,
+    const int slice_index,
+    const int axis_to_collapse,
+    const PLANE_ROTATION_TYPE& rotation,
+    const bool use_nearest_neighbor=false,
+    const unsigned int number_of_threads=0
+) {
+    // Resamples the plane through the center of slice_index on axis_to_collapse, rotated by rotation about that point
+    // The output has the size and spacing of the axis aligned slice. Use nearest neighbor interpolation for label images
+    // number_of_threads limits the resampler, 0 leaves it at ITK's global default
+    // The plane is expressed as the output grid of a ResampleImageFilter, which walks the atlas scanline by scanline
+    //  on multiple threads, and evaluates linear grids incrementally rather than transforming every point
+    typedef itk::Image<typename IMAGE_TYPE::PixelType, 3> SlicedImageType;
+    typedef itk::ResampleImageFilter<SlicedImageType, SlicedImageType> ResamplerType;
+    typedef itk::IdentityTransform<double, 3> TransformType;
+    typedef itk::LinearInterpolateImageFunction<SlicedImageType, double> LinearInterpolatorType;
+    typedef itk::NearestNeighborInterpolateImageFunction<SlicedImageType, double> NearestInterpolatorType;
+
+    typename SlicedImageType::RegionType entire_atlas_region = image_to_slice->GetLargestPossibleRegion();
+    typename SlicedImageType::SizeType slice_size = entire_atlas_region.GetSize();
+    slice_size[axis_to_collapse] = 1;
+
+    // Find the center of the axis aligned slice, and the offset from it to the first pixel of the slice
+    itk::ContinuousIndex<double, 3> slice_center_index;
+    itk::Vector<double, 3> center_offset;
+    for (int i = 0; i < 3; i++) {
+        const double half_width = i == axis_to_collapse ? 0.0 : (slice_size[i] - 1) / 2.0;
+        slice_center_index[i] = entire_atlas_region.GetIndex()[i] + (i == axis_to_collapse ? slice_index : half_width);
+        center_offset[i] = half_width * image_to_slice->GetSpacing()[i];
+    }
+    typename SlicedImageType::PointType slice_center;
+    image_to_slice->TransformContinuousIndexToPhysicalPoint(slice_center_index, slice_center);
+
+    // Rotate the output grid about the slice center
+    typename SlicedImageType::DirectionType slice_direction = image_to_slice->GetDirection() * rotation;
+    typename SlicedImageType::PointType slice_origin = slice_center - slice_direction * center_offset;
+
+    typename ResamplerType::Pointer resampler = ResamplerType::New();
+    resampler->SetInput(image_to_slice);
+    resampler->SetTransform(TransformType::New());
+    resampler->SetSize(slice_size);
+    resampler->SetOutputOrigin(slice_origin);
+    resampler->SetOutputSpacing(image_to_slice->GetSpacing());
+    resampler->SetOutputDirection(slice_direction);
+    resampler->SetDefaultPixelValue(0);
+    if (number_of_threads > 0) {
+        resampler->SetNumberOfThreads(number_of_threads);
+    }
+
+    if (use_nearest_neighbor) {
+        resampler->SetInterpolator(NearestInterpolatorType::New());
+    } else {
+        resampler->SetInterpolator(LinearInterpolatorType::New());
+    }
+
+    resampler->Update();
+    return extract_image_slice<IMAGE_TYPE>(resampler->GetOutput(), 0, axis_to_collapse);
 }
 
+template<typename IMAGE_TYPE>
+typename IMAGE_TYPE::Pointer extract_bricked_slice(
+    const typename BrickedAtlas<typename IMAGE_TYPE::PixelType>::Pointer atlas,
+    const int slice_index,
+    const int axis_to_collapse
+) {
+    // Returns the slice at slice_index on axis_to_collapse of a bricked atlas, described like extract_image_slice
+    // Only the bricks the slice crosses are read, one brick at a time, so the cost is about the same on every axis
+    typedef typename IMAGE_TYPE::PixelType PixelType;
+    const unsigned long long brick_size = atlas->GetBrickSize();
+    const typename BrickedAtlas<PixelType>::ImageType::SizeType atlas_size = atlas->GetLargestPossibleRegion().GetSize();
+
+    // The remaining axes of the atlas become the axes of the slice
+    const int slice_axes[2] = {axis_to_collapse == 0 ? 1 : 0, axis_to_collapse == 2 ? 1 : 2};
+    typename IMAGE_TYPE::SizeType slice_size;
+    typename IMAGE_TYPE::SpacingType slice_spacing;
+    typename IMAGE_TYPE::PointType slice_origin;
+    for (int i = 0; i < 2; i++) {
+        slice_size[i] = atlas_size[slice_axes[i]];
+        slice_spacing[i] = atlas->GetSpacing()[slice_axes[i]];
+        slice_origin[i] = atlas->GetOrigin()[slice_axes[i]];
+    }
+
+    typename IMAGE_TYPE::Pointer slice = IMAGE_TYPE::New();
+    slice->SetRegions(slice_size);
+    slice->SetSpacing(slice_spacing);
+    slice->SetOrigin(slice_origin);
+    slice->Allocate();
+    PixelType* output = slice->GetBufferPointer();
+
+    // Distance between neighbouring pixels within a brick, along each atlas axis
+    const unsigned long long brick_strides[3] = {1, brick_size, brick_size * brick_size};
+    const unsigned long long row_stride = brick_strides[slice_axes[0]];
+    const unsigned long long column_stride = brick_strides[slice_axes[1]];
+
+    unsigned long long brick_coordinates[3];
+    brick_coordinates[axis_to_collapse] = slice_index / brick_size;
+    const unsigned long long plane_offset = (slice_index % brick_size) * brick_strides[axis_to_collapse];
+
+    for (unsigned long long brick_column = 0; brick_column < atlas->GetBricksPerAxis(slice_axes[1]); brick_column++) {
+        for (unsigned long long brick_row = 0; brick_row < atlas->GetBricksPerAxis(slice_axes[0]); brick_row++) {
+            brick_coordinates[slice_axes[0]] = brick_row;
+            brick_coordinates[slice_axes[1]] = brick_column;
+            const PixelType* brick = atlas->GetBrick(brick_coordinates[0], brick_coordinates[1], brick_coordinates[2]) + plane_offset;
+
+            // Copy the part of the plane inside this brick, skipping the padding of edge bricks
+            const unsigned long long first_x = brick_row * brick_size;
+            const unsigned long long first_y = brick_column * brick_size;
+            const unsigned long long width = std::min<unsigned long long>(brick_size, slice_size[0] - first_x);
+            const unsigned long long height = std::min<unsigned long long>(brick_size, slice_size[1] - first_y);
+            for (unsigned long long y = 0; y < height; y++) {
+                const PixelType* input = brick + y * column_stride;
+                PixelType* output_row = output + first_x + (first_y + y) * slice_size[0];
+                for (unsigned long long x = 0; x < width; x++, input += row_stride) {
+                    output_row[x] = *input;
+                }
+            }
+        }
+    }
+
+    return slice;
+}
 
 #endif
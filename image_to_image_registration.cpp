@@ -70,6 +70,109 @@ public:
 };
 
 
+// Thrown by MetricPlateauMonitor to end a level, the LBFGSB optimizer cannot be stopped otherwise
+class MetricPlateauReached : public itk::ExceptionObject {
+public:
+    MetricPlateauReached(const char* file, unsigned int line) : itk::ExceptionObject(file, line) {};
+    virtual const char* GetNameOfClass() const ITK_OVERRIDE { return "MetricPlateauReached"; }
+};
+
+
+// Observer that stops a level once the metric has flattened
+// It keeps the metric value of every iteration, and compares the latest with the one window iterations before it
+class MetricPlateauMonitor : public itk::Command {
+public:
+    typedef MetricPlateauMonitor Self;
+    typedef itk::Command Superclass;
+    typedef itk::SmartPointer<Self> Pointer;
+    itkNewMacro(Self);
+
+    typedef itk::LBFGSBOptimizerv4 OptimizerType;
+    typedef const OptimizerType * OptimizerPointer;
+
+private:
+    EarlyStopping criteria;
+    vector<double> metric_values;
+    OptimizerType::ParametersType final_position;
+    double final_value;
+    string stop_reason;
+
+protected:
+    MetricPlateauMonitor() : final_value(0) {
+        criteria.window = 10;
+        criteria.threshold = 0;
+    };
+
+public:
+    void SetCriteria(const EarlyStopping& early_stopping) { criteria = early_stopping; }
+    const OptimizerType::ParametersType& GetFinalPosition() const { return final_position; }
+    double GetFinalValue() const { return final_value; }
+    const string& GetStopReason() const { return stop_reason; }
+
+    void Execute(itk::Object *caller, const itk::EventObject & event) ITK_OVERRIDE {
+        Execute( (const itk::Object *)caller, event);
+    }
+
+    void Execute(const itk::Object * object, const itk::EventObject & event) ITK_OVERRIDE {
+        OptimizerPointer optimizer = static_cast< OptimizerPointer >( object );
+        if( !(itk::IterationEvent().CheckEvent( &event )) || criteria.threshold <= 0 ){
+            return;
+        }
+
+        metric_values.push_back(optimizer->GetCurrentMetricValue());
+        if (metric_values.size() <= criteria.window) {
+            return;
+        }
+
+        const double latest = metric_values.back();
+        const double earlier = metric_values[metric_values.size() - 1 - criteria.window];
+        const double relative_change = fabs(earlier - latest) / max(fabs(earlier), 1e-12);
+        if (relative_change < criteria.threshold) {
+            ostringstream reason;
+            reason << "Metric changed by " << relative_change << " (relative) over the last " << criteria.window
+                   << " iterations, below the threshold of " << criteria.threshold;
+            stop_reason = reason.str();
+            final_position = optimizer->GetCurrentPosition();
+            final_value = latest;
+            throw MetricPlateauReached(__FILE__, __LINE__);
+        }
+    }
+};
+
+
+template<typename RegistrationType, typename TRANSFORM_TYPE>
+double run_registration_level(typename RegistrationType::Pointer registration, itk::LBFGSBOptimizerv4::Pointer optimizer, typename TRANSFORM_TYPE::Pointer transform, const EarlyStopping& early_stopping, bool report_progress) {
+    // Runs a registration that optimizes transform in place, stopping early once the metric flattens
+    // Returns the metric value at the final parameters of transform
+    MetricPlateauMonitor::Pointer monitor = MetricPlateauMonitor::New();
+    monitor->SetCriteria(early_stopping);
+    optimizer->AddObserver(itk::IterationEvent(), monitor);
+
+    string stop_reason;
+    double final_value = 0;
+    try {
+        registration->Update();
+        stop_reason = optimizer->GetStopConditionDescription();
+        final_value = optimizer->GetCurrentMetricValue();
+    } catch ( MetricPlateauReached & ) {
+        // The transform and the optimizer may hold a line search point evaluated after the last iteration,
+        //  so both the position and its metric value are taken from that iteration
+        transform->SetParametersByValue(monitor->GetFinalPosition());
+        final_value = monitor->GetFinalValue();
+        stop_reason = monitor->GetStopReason();
+    } catch ( itk::ExceptionObject & err ) {
+        cerr << "ExceptionObject caught !" << endl;
+        cerr << err << endl;
+        throw -1;
+    }
+
+    if (report_progress) {
+        cout << "Optimizer stop condition: " << stop_reason << endl;
+    }
+    return final_value;
+}
+
+
 // option parsing
 struct Arg: public option::Arg {
    static void printError(const char* msg1, const option::Option& opt, const char* msg2) {
@@ -109,7 +212,29 @@ enum optionIndex {
     MOVING_IMAGE,
     OUTPUT_PATH,
     TRANSFORM_PATH,
-    APPLICATION_TARGET
+    APPLICATION_TARGET,
+    BATCH_FILE,
+    CONCURRENT_JOBS,
+    RIGID_START_ANGLES,
+    RIGID_TRY_FLIPS,
+    RIGID_STARTS_TO_REFINE,
+    RIGID_SHRINK_FACTORS,
+    RIGID_SMOOTHING_SIGMAS,
+    RIGID_ITERATIONS,
+    SAMPLING_STRATEGY,
+    SAMPLING_SEED,
+    RIGID_SAMPLING,
+    BSPLINE_SAMPLING,
+    PLATEAU_WINDOW,
+    PLATEAU_THRESHOLD,
+    MESH_SCHEDULE,
+    THREADS,
+    STAGE_THREADS,
+    CACHE_FIELD,
+    DISPLACEMENT_FIELD,
+    APPLY_IN_FLIGHT,
+    APPLY_MEMORY,
+    INTERPOLATION
 };
 
 
@@ -122,6 +247,49 @@ const option::Descriptor usage[] = {
     {OUTPUT_PATH, 0, "o", "output", Arg::Required, "--output, -o path \tPath to save the output moving image"},
     {TRANSFORM_PATH, 0, "t", "transform", Arg::Required, "--transform, -t path \tPath to save the computed transform"},
     {APPLICATION_TARGET, 0, "a", "apply", Arg::Required, "--apply, -a input_path,output_path \tPaths to additional images to apply the transform to"},
+    {BATCH_FILE, 0, "b", "batch", Arg::Required, "--batch, -b path \tRegister many moving images to the fixed image, instead of --moving\n"
+                                                 "Each line of the file is moving_path,output_path[,transform_path]"},
+    {CONCURRENT_JOBS, 0, "j", "jobs", Arg::Numeric, "--jobs, -j int \tNumber of batch registrations to run at once\n"
+                                                    "Default: 1"},
+    {RIGID_START_ANGLES, 0, "", "rigid_angles", Arg::Required, "--rigid_angles angle,angle,... \tStart the rigid registration from each of these angles, in degrees,\n"
+                                                               "and keep the best. Volumes are rotated about their third axis. Default: 0"},
+    {RIGID_TRY_FLIPS, 0, "", "rigid_flips", Arg::None, "--rigid_flips \tAlso start the rigid registration from the moving image flipped left to right"},
+    {RIGID_STARTS_TO_REFINE, 0, "", "rigid_refine", Arg::Numeric, "--rigid_refine int \tNumber of the best rigid starts, compared at a coarse resolution,\n"
+                                                                  "to refine at full resolution. Default: 1"},
+    {RIGID_SHRINK_FACTORS, 0, "", "rigid_shrink", Arg::Required, "--rigid_shrink int,int,... \tShrink factor of each level of the rigid stage, coarsest first\n"
+                                                                 "Default: 4,2,1, or 8,4,2 for volumes"},
+    {RIGID_SMOOTHING_SIGMAS, 0, "", "rigid_sigmas", Arg::Required, "--rigid_sigmas float,float,... \tSmoothing sigma of each level of the rigid stage, in physical units\n"
+                                                                   "Default: 2,1,0, or 4,2,1 for volumes"},
+    {RIGID_ITERATIONS, 0, "", "rigid_iterations", Arg::Required, "--rigid_iterations int,int,... \tMaximum optimizer iterations at each level of the rigid stage\n"
+                                                                 "Default: 200,100,50"},
+    {SAMPLING_STRATEGY, 0, "", "sampling", Arg::Required, "--sampling none|regular|random \tHow the metrics sample the fixed image.\n"
+                                                          "Default: none, every pixel, or random for volumes"},
+    {SAMPLING_SEED, 0, "", "sampling_seed", Arg::Numeric, "--sampling_seed int \tSeed of random sampling, for reproducible registrations. Default: 1"},
+    {RIGID_SAMPLING, 0, "", "rigid_sampling", Arg::Required, "--rigid_sampling percent,percent,... \tPercentage of the fixed image sampled at each level of the rigid stage\n"
+                                                             "Default: 100 at every level, or 50,25,10 for volumes, with the last repeated for extra levels"},
+    {BSPLINE_SAMPLING, 0, "", "bspline_sampling", Arg::Required, "--bspline_sampling percent,percent,... \tPercentage of the fixed image sampled at each level of the B-spline stage\n"
+                                                                 "Default: 100 at every level, or 25,10,5 for volumes, with the last repeated for extra levels"},
+    {PLATEAU_WINDOW, 0, "", "plateau_window", Arg::Numeric, "--plateau_window int \tNumber of iterations the metric change is measured over. Default: 10"},
+    {PLATEAU_THRESHOLD, 0, "", "plateau_threshold", Arg::Required, "--plateau_threshold float \tStop a level once the metric changed by less than this, relative to its value,\n"
+                                                                   "over the window. 0 runs every level to its iteration budget. Default: 1e-5"},
+    {MESH_SCHEDULE, 0, "", "mesh_schedule", Arg::Required, "--mesh_schedule int[,int,...] \tB-spline mesh size of each level of the B-spline stage, coarsest first.\n"
+                                                           "A single size is used at the coarsest level and doubled at each finer level. Default: 5 at every level"},
+    {THREADS, 0, "", "threads", Arg::Required, "--threads int|auto \tThreads to use in total, shared between concurrent batch jobs.\n"
+                                               "auto uses every cpu allowed by the cgroup cpu quota and cpu affinity.\n"
+                                               "Default: auto for a batch, ITK's default for a single registration"},
+    {STAGE_THREADS, 0, "", "stage_threads", Arg::Required, "--stage_threads io,rigid,bspline,resample \tThreads for each stage of every registration\n"
+                                                           "Default: every stage uses the job's full share of --threads, as the stages run one after another"},
+    {CACHE_FIELD, 0, "", "cache_field", Arg::None, "--cache_field \tEvaluate the transform once into a displacement field, and warp every --apply image\n"
+                                                   "through it. Images on another grid than the moving image are resampled through the transform"},
+    {DISPLACEMENT_FIELD, 0, "", "displacement_field", Arg::Required, "--displacement_field path \tSave the displacement field to path, for apply_transform --field.\n"
+                                                                     "Implies --cache_field"},
+    {APPLY_IN_FLIGHT, 0, "", "apply_in_flight", Arg::Numeric, "--apply_in_flight int \t--apply images being read, resampled or written at once.\n"
+                                                              "Reading, resampling and writing overlap. Images on one grid are resampled together,\n"
+                                                              "and more of them than this are only read once nothing else is in flight. Default: 2"},
+    {APPLY_MEMORY, 0, "", "apply_memory", Arg::Numeric, "--apply_memory MB \tMemory the --apply images in flight may hold, 0 for no limit.\n"
+                                                        "Images on one grid are resampled together in chunks of at most a third of it. Default: 0"},
+    {INTERPOLATION, 0, "p", "interpolation", Arg::Required, "--interpolation, -p type \tInterpolation of the output and --apply images: nearest, linear, bspline or sinc\n"
+                                                            "Default: bspline. Use nearest for label images, linear for quick previews"},
     {0,0,0,0,0,0}
 };
 
@@ -141,125 +309,437 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    // Load images
-    IMAGE_TYPE::Pointer fixed_image = load_image<IMAGE_TYPE>(options[FIXED_IMAGE].arg);
-    IMAGE_TYPE::Pointer moving_image = load_image<IMAGE_TYPE>(options[MOVING_IMAGE].arg);
+    if (options[BATCH_FILE] && !options[FIXED_IMAGE]) {
+        cout << "Insufficient Arguments!!" << endl;
+        cout << "Please specify a fixed image to register the batch to." << endl;
+        option::printUsage(cout, usage);
+        return 1;
+    }
 
-    // Compute transform
-    RIGID_TRANSFORM_TYPE::Pointer rigid_transform = compute_rigid_transform(fixed_image, moving_image);    
-    moving_image = apply_transform<IMAGE_TYPE, RIGID_TRANSFORM_TYPE>(moving_image, rigid_transform);
-    BSPLINE_TRANSFORM_TYPE::Pointer bspline_transform = compute_bSpline_transform(fixed_image, moving_image);
+    if (!options[BATCH_FILE] && (!options[FIXED_IMAGE] || !options[MOVING_IMAGE] || !options[OUTPUT_PATH])) {
+        cout << "Insufficient Arguments!!" << endl;
+        cout << "Please specify a fixed image, a moving image, and an output path." << endl;
+        option::printUsage(cout, usage);
+        return 1;
+    }
 
-    // Apply tranform
-    IMAGE_TYPE::Pointer output_image = apply_transform<IMAGE_TYPE, BSPLINE_TRANSFORM_TYPE>(moving_image, bspline_transform);
-    write_image<IMAGE_TYPE>(output_image, options[OUTPUT_PATH].arg);
+    if (options[CONCURRENT_JOBS] && atoi(options[CONCURRENT_JOBS].arg) < 1) {
+        cerr << "--jobs must be at least 1" << endl;
+        return 1;
+    }
+
+    // Sections and volumes go through the same pipeline, picked by the dimension of the fixed image
+    unsigned int dimensions = 0;
+    RegistrationSettings settings;
+    try {
+        dimensions = read_image_dimension(options[FIXED_IMAGE].arg);
+        settings = get_registration_settings(options, dimensions);
+    } catch (exception & err) {
+        cerr << err.what() << endl;
+        return 1;
+    }
 
-    // Optionally save transform
-    if (options[TRANSFORM_PATH]) {
-       COMPOSITE_TRANSFORM_TYPE::Pointer composite_transform = compose_transforms(rigid_transform, bspline_transform);
-       write_transform<COMPOSITE_TRANSFORM_TYPE>(composite_transform, options[TRANSFORM_PATH].arg);
+    if (dimensions == 2) {
+        return register_images<RegistrationTypes<2> >(options, settings);
+    } else if (dimensions == 3) {
+        return register_images<RegistrationTypes<3> >(options, settings);
     }
 
-    // Apply images to additional images
-    string arg_str;
-    vector<string> io_paths;
+    cerr << "Only 2d images and 3d volumes can be registered, " << options[FIXED_IMAGE].arg
+         << " has " << dimensions << " dimensions" << endl;
+    return 1;
+}
+
+
+template<typename TYPES>
+int register_images(option::Option* options, const RegistrationSettings& settings) {
+    // Runs the registration asked for by options, on images with TYPES::Dimensions dimensions
+    typedef typename TYPES::IMAGE_TYPE IMAGE_TYPE;
+    typedef typename TYPES::IMAGE_PYRAMID_TYPE IMAGE_PYRAMID_TYPE;
+    typedef typename TYPES::COMPOSITE_TRANSFORM_TYPE COMPOSITE_TRANSFORM_TYPE;
+    typedef typename DisplacementFieldTypes<IMAGE_TYPE>::FIELD_TYPE FIELD_TYPE;
+
+    // In batch mode, every moving image is registered to the same fixed image
+    if (options[BATCH_FILE]) {
+        vector<RegistrationJob> jobs = read_batch_file(options[BATCH_FILE].arg);
+        const unsigned int number_of_concurrent_jobs = options[CONCURRENT_JOBS] ? atoi(options[CONCURRENT_JOBS].arg) : 1;
+        typename IMAGE_TYPE::Pointer fixed_image = load_image<IMAGE_TYPE>(options[FIXED_IMAGE].arg);
+        register_batch<TYPES>(fixed_image, jobs, settings, number_of_concurrent_jobs);
+        return 0;
+    }
+
+    if (read_image_dimension(options[MOVING_IMAGE].arg) != TYPES::Dimensions) {
+        cerr << "The moving image must have as many dimensions as the fixed image" << endl;
+        return 1;
+    }
+
+    // The images and pyramids of the registration are released before the additional images are warped
+    typename COMPOSITE_TRANSFORM_TYPE::Pointer resampling_transform;
+    typename FIELD_TYPE::Pointer displacement_field;
+    {
+        // Load images
+        typename IMAGE_TYPE::Pointer fixed_image = load_image<IMAGE_TYPE>(options[FIXED_IMAGE].arg);
+        typename IMAGE_TYPE::Pointer moving_image = load_image<IMAGE_TYPE>(options[MOVING_IMAGE].arg);
+
+        // Compute transform
+        IMAGE_PYRAMID_TYPE fixed_rigid_pyramid = build_image_pyramid<TYPES>(fixed_image, settings.rigid_schedule, true, settings.io_threads);
+        IMAGE_PYRAMID_TYPE fixed_bspline_pyramid = build_image_pyramid<TYPES>(fixed_image, settings.bspline_schedule, true, settings.io_threads);
+        RegistrationResult<TYPES> result = register_moving_image<TYPES>(fixed_image, fixed_rigid_pyramid, fixed_bspline_pyramid, settings, moving_image);
+        resampling_transform = get_resampling_transform<TYPES>(result);
+
+        // Apply tranform
+        write_image<IMAGE_TYPE>(result.output_image, options[OUTPUT_PATH].arg);
+
+        // Optionally save transform
+        if (options[TRANSFORM_PATH]) {
+           write_registration_transform<TYPES>(result, settings, options[TRANSFORM_PATH].arg);
+        }
+
+        // Optionally evaluate the transform once, on the grid the moving image was resampled onto
+        if (options[CACHE_FIELD] || options[DISPLACEMENT_FIELD]) {
+            displacement_field = compute_displacement_field<IMAGE_TYPE, COMPOSITE_TRANSFORM_TYPE>(moving_image, resampling_transform, settings.resample_threads);
+            if (options[DISPLACEMENT_FIELD]) {
+                write_image<FIELD_TYPE>(displacement_field, options[DISPLACEMENT_FIELD].arg);
+            }
+        }
+    }
+
+    // Apply images to additional images, each is resampled once through the fused transform
+    vector<vector<string> > targets;
     for (option::Option* opt = options[APPLICATION_TARGET]; opt; opt = opt->next()) {
-        arg_str = opt->arg;
-        io_paths = split(arg_str, ',');
-        moving_image = load_image<IMAGE_TYPE>(io_paths[0].c_str());
-        moving_image = apply_transform<IMAGE_TYPE, RIGID_TRANSFORM_TYPE>(moving_image, rigid_transform);
-        moving_image = apply_transform<IMAGE_TYPE, BSPLINE_TRANSFORM_TYPE>(moving_image, bspline_transform);
-        write_image<IMAGE_TYPE>(moving_image, io_paths[1].c_str());
+        targets.push_back(split(string(opt->arg), ','));
     }
+    apply_to_targets<TYPES>(targets, resampling_transform, displacement_field, settings);
 
     return 0;
 }
 
 
-RIGID_TRANSFORM_TYPE::Pointer compute_rigid_transform(IMAGE_TYPE::Pointer fixed_image, IMAGE_TYPE::Pointer moving_image) {
+template<typename RegistrationType>
+void configure_metric_sampling(typename RegistrationType::Pointer registration, const PyramidSchedule& schedule, unsigned int level) {
+    // Samples the fixed image at level as schedule asks, registrations are always run one level at a time
+    typename RegistrationType::MetricSamplingPercentageArrayType sampling_percentage;
+    sampling_percentage.SetSize(1);
+    sampling_percentage[0] = schedule.sampling_percentages[level] / 100.0;
+
+    switch (schedule.sampling.strategy) {
+        case SAMPLE_REGULAR:
+            registration->SetMetricSamplingStrategy(RegistrationType::REGULAR);
+            break;
+        case SAMPLE_RANDOM:
+            registration->SetMetricSamplingStrategy(RegistrationType::RANDOM);
+            break;
+        default:
+            registration->SetMetricSamplingStrategy(RegistrationType::NONE);
+            sampling_percentage[0] = 1.0;
+    }
+    registration->SetMetricSamplingPercentagePerLevel(sampling_percentage);
+    registration->MetricSamplingReinitializeSeed(schedule.sampling.seed);
+}
+
+
+template<typename RegistrationType, typename MetricType>
+void configure_registration_threads(typename RegistrationType::Pointer registration, typename MetricType::Pointer metric, itk::LBFGSBOptimizerv4::Pointer optimizer, unsigned int number_of_threads) {
+    // Limits every part of a registration to number_of_threads, 0 leaves them at ITK's global default
+    if (number_of_threads > 0) {
+        registration->SetNumberOfThreads(number_of_threads);
+        metric->SetMaximumNumberOfThreads(number_of_threads);
+        optimizer->SetNumberOfThreads(number_of_threads);
+    }
+}
+
+
+// Sets the rotation of a rigid transform to angle, in radians
+// Volumes are rotated about their third axis, the normal of the sections they are cut into
+void set_rigid_rotation(itk::CenteredRigid2DTransform<double>* transform, double angle) {
+    transform->SetAngle(angle);
+}
+
+
+void set_rigid_rotation(itk::Euler3DTransform<double>* transform, double angle) {
+    transform->SetRotation(0.0, 0.0, angle);
+}
+
+
+template<typename TYPES>
+typename TYPES::RIGID_TRANSFORM_TYPE::Pointer initialize_rigid_transform(typename TYPES::IMAGE_TYPE::Pointer fixed_image, typename TYPES::IMAGE_TYPE::Pointer moving_image) {
+    typedef typename TYPES::IMAGE_TYPE IMAGE_TYPE;
+    typedef typename TYPES::RIGID_TRANSFORM_TYPE RIGID_TRANSFORM_TYPE;
+    typedef itk::CenteredTransformInitializer<RIGID_TRANSFORM_TYPE, IMAGE_TYPE, IMAGE_TYPE> TransformInitializerType;
+    typename RIGID_TRANSFORM_TYPE::Pointer transform = RIGID_TRANSFORM_TYPE::New();
+
+    // Initialize the transform using center of mass
+    typename TransformInitializerType::Pointer initializer = TransformInitializerType::New();
+    initializer->SetFixedImage(fixed_image);
+    initializer->SetMovingImage(moving_image);
+    initializer->SetTransform(transform);
+
+    initializer->MomentsOn();  // MomentsOn() sets the initializer to center mass mode
+
+    initializer->InitializeTransform();
+    set_rigid_rotation(transform.GetPointer(), 0.0);
+    return transform;
+}
+
+
+template<typename TYPES>
+double optimize_rigid_transform(typename TYPES::IMAGE_TYPE::Pointer fixed_image, typename TYPES::IMAGE_TYPE::Pointer moving_image, typename TYPES::RIGID_TRANSFORM_TYPE::Pointer transform, const PyramidSchedule& schedule, unsigned int level, bool report_progress) {
+    // Optimizes transform in place on one level of schedule, and returns the final value of the metric
+    // fixed_image and moving_image are that level of the fixed and moving pyramids
+    typedef typename TYPES::IMAGE_TYPE IMAGE_TYPE;
+    typedef typename TYPES::RIGID_TRANSFORM_TYPE RIGID_TRANSFORM_TYPE;
     typedef itk::ImageRegistrationMethodv4<IMAGE_TYPE, IMAGE_TYPE> RegistrationType;
     typedef itk::LBFGSBOptimizerv4 OptimizerType;
     typedef itk::MeanSquaresImageToImageMetricv4<IMAGE_TYPE, IMAGE_TYPE> MetricType;
-    typedef itk::LinearInterpolateImageFunction<IMAGE_TYPE, double> InterpolatorType;
-    typedef itk::CenteredTransformInitializer<RIGID_TRANSFORM_TYPE, IMAGE_TYPE, IMAGE_TYPE> TransformInitializerType;
 
-    // Instantiate the metric, optimizer, interpolator and registration objects
-    MetricType::Pointer           metric        = MetricType::New();
-    OptimizerType::Pointer        optimizer     = OptimizerType::New();
-    InterpolatorType::Pointer     interpolator  = InterpolatorType::New();
-    RIGID_TRANSFORM_TYPE::Pointer   transform     = RIGID_TRANSFORM_TYPE::New();
-    RegistrationType::Pointer     registration  = RegistrationType::New();
+    // Instantiate the metric, optimizer and registration objects
+    typename MetricType::Pointer        metric        = MetricType::New();
+    OptimizerType::Pointer              optimizer     = OptimizerType::New();
+    typename RegistrationType::Pointer  registration  = RegistrationType::New();
 
     // Set up the registration
     registration->SetMetric(metric);
     registration->SetOptimizer(optimizer);
     registration->SetInitialTransform(transform);
+    registration->InPlaceOn();
 
-    // Set the inputs
+    // Set the inputs, which are already smoothed and shrunk
     registration->SetFixedImage(fixed_image);
     registration->SetMovingImage(moving_image);
 
-    // Initialize the transform using center of mass
-    TransformInitializerType::Pointer initializer = TransformInitializerType::New();
-    initializer->SetFixedImage(fixed_image);
-    initializer->SetMovingImage(moving_image);
-    initializer->SetTransform(transform);
+    typename RegistrationType::ShrinkFactorsArrayType shrink_factor_per_level;
+    shrink_factor_per_level.SetSize(1);
+    shrink_factor_per_level[0] = 1;
 
-    initializer->MomentsOn();  // MomentsOn() sets the initializer to center mass mode
+    typename RegistrationType::SmoothingSigmasArrayType sigma_per_level;
+    sigma_per_level.SetSize(1);
+    sigma_per_level[0] = 0;
 
-    initializer->InitializeTransform();
-    transform->SetAngle(0.0);
+    registration->SetNumberOfLevels(1);
+    registration->SetShrinkFactorsPerLevel(shrink_factor_per_level);
+    registration->SetSmoothingSigmasPerLevel(sigma_per_level);
+    configure_metric_sampling<RegistrationType>(registration, schedule, level);
+    configure_registration_threads<RegistrationType, MetricType>(registration, metric, optimizer, schedule.number_of_threads);
 
     // Configure the optimizer
     const unsigned int num_params = transform->GetNumberOfParameters();
-    configure_optimizer(optimizer, num_params);
+    configure_optimizer(optimizer, num_params, schedule.iterations[level]);
 
     // The command observer will report on the registrations progress at each iteration
     //  The class definition is below, and taken directly from the ImageRegistration6.cxx example
-    CommandIterationUpdate::Pointer observer = CommandIterationUpdate::New();
-    optimizer->AddObserver(itk::IterationEvent(), observer);
+    if (report_progress) {
+        CommandIterationUpdate::Pointer observer = CommandIterationUpdate::New();
+        optimizer->AddObserver(itk::IterationEvent(), observer);
+    }
 
-    // Begin Registration by calling Update()
-    try {
-        registration->Update();
-        cout << "Optimizer stop condition: "
-                  << registration->GetOptimizer()->GetStopConditionDescription()
-                  << endl;
-    } catch ( itk::ExceptionObject & err ) {
-        cerr << "ExceptionObject caught !" << endl;
-        cerr << err << endl;
-        throw -1;
+    // Begin Registration
+    return run_registration_level<RegistrationType, RIGID_TRANSFORM_TYPE>(registration, optimizer, transform, schedule.early_stopping, report_progress);
+}
+
+
+template<typename TYPES>
+double optimize_rigid_transform(const typename TYPES::IMAGE_PYRAMID_TYPE& fixed_pyramid, const typename TYPES::IMAGE_PYRAMID_TYPE& moving_pyramid, typename TYPES::RIGID_TRANSFORM_TYPE::Pointer transform, const PyramidSchedule& schedule, unsigned int first_level, bool report_progress) {
+    // Optimizes transform in place on each level of the pyramids from first_level on, continuing from the previous level
+    // Most iterations run on the coarse levels, where the metric is cheap to evaluate
+    // Returns the final value of the metric, or that of the transform as given if there are no levels left
+    double metric_value = numeric_limits<double>::max();
+    for (unsigned int level = first_level; level < fixed_pyramid.size(); level++) {
+        if (report_progress) {
+            cout << "Rigid level " << level << ", shrink factor " << schedule.shrink_factors[level] << endl;
+        }
+        metric_value = optimize_rigid_transform<TYPES>(fixed_pyramid[level], moving_pyramid[level], transform, schedule, level, report_progress);
     }
+    return metric_value;
+}
 
+
+template<typename TYPES>
+typename TYPES::RIGID_TRANSFORM_TYPE::Pointer compute_rigid_transform(typename TYPES::IMAGE_TYPE::Pointer fixed_image, typename TYPES::IMAGE_TYPE::Pointer moving_image) {
+    typedef typename TYPES::IMAGE_PYRAMID_TYPE IMAGE_PYRAMID_TYPE;
+    PyramidSchedule schedule = get_rigid_pyramid_schedule(TYPES::Dimensions);
+    IMAGE_PYRAMID_TYPE fixed_pyramid = build_image_pyramid<TYPES>(fixed_image, schedule, true, schedule.number_of_threads);
+    IMAGE_PYRAMID_TYPE moving_pyramid = build_image_pyramid<TYPES>(moving_image, schedule, false, schedule.number_of_threads);
+    typename TYPES::RIGID_TRANSFORM_TYPE::Pointer transform = initialize_rigid_transform<TYPES>(fixed_image, moving_image);
+    optimize_rigid_transform<TYPES>(fixed_pyramid, moving_pyramid, transform, schedule, 0, true);
     return transform;
 }
 
 
-BSPLINE_TRANSFORM_TYPE::Pointer compute_bSpline_transform(IMAGE_TYPE::Pointer fixed_image, IMAGE_TYPE::Pointer moving_image){
+// A starting point of the multi-start rigid stage
+template<typename TYPES>
+struct RigidCandidate {
+    typename TYPES::RIGID_TRANSFORM_TYPE::Pointer transform;
+    bool flipped;
+    double metric_value;
+
+    bool operator<(const RigidCandidate& other) const { return metric_value < other.metric_value; }
+};
+
+
+template<typename TYPES>
+typename TYPES::RIGID_TRANSFORM_TYPE::Pointer compute_multistart_rigid_transform(typename TYPES::IMAGE_TYPE::Pointer fixed_image, const typename TYPES::IMAGE_PYRAMID_TYPE& fixed_pyramid, typename TYPES::IMAGE_TYPE::Pointer moving_image, const RegistrationSettings& settings, typename TYPES::FLIP_TRANSFORM_TYPE::Pointer& flip_transform) {
+    // Runs the rigid stage from every start angle, and with the moving image flipped if requested
+    // fixed_pyramid was built from settings.rigid_schedule with build_image_pyramid
+    // The starts are optimized concurrently on the coarsest level, then the best few are refined through the finer levels
+    // Sets flip_transform when the best result needed the moving image flipped, and to null otherwise
+    typedef typename TYPES::IMAGE_TYPE IMAGE_TYPE;
+    typedef typename TYPES::IMAGE_PYRAMID_TYPE IMAGE_PYRAMID_TYPE;
+    typedef typename TYPES::RIGID_TRANSFORM_TYPE RIGID_TRANSFORM_TYPE;
+    typedef typename TYPES::FLIP_TRANSFORM_TYPE FLIP_TRANSFORM_TYPE;
+    typedef RigidCandidate<TYPES> CandidateType;
+
+    const PyramidSchedule& schedule = settings.rigid_schedule;
+    flip_transform = NULL;
+    const unsigned int number_of_orientations = settings.rigid_try_flips ? 2 : 1;
+    if (settings.rigid_start_angles.size() * number_of_orientations <= 1) {
+        const double start_angle = settings.rigid_start_angles.empty() ? 0.0 : settings.rigid_start_angles[0];
+        IMAGE_PYRAMID_TYPE moving_pyramid = build_image_pyramid<TYPES>(moving_image, schedule, false, schedule.number_of_threads);
+        typename RIGID_TRANSFORM_TYPE::Pointer transform = initialize_rigid_transform<TYPES>(fixed_image, moving_image);
+        set_rigid_rotation(transform.GetPointer(), start_angle * M_PI / 180.0);
+        optimize_rigid_transform<TYPES>(fixed_pyramid, moving_pyramid, transform, schedule, 0, true);
+        return transform;
+    }
+
+    // Prepare the pyramids of the (flipped) moving images
+    typename FLIP_TRANSFORM_TYPE::Pointer mirror = create_flip_transform<TYPES>(moving_image);
+    typename IMAGE_TYPE::Pointer oriented_images[2] = {moving_image, NULL};
+    if (settings.rigid_try_flips) {
+        // The flip maps pixel centers onto pixel centers, so nearest neighbor resampling copies the pixels exactly
+        oriented_images[1] = apply_transform<IMAGE_TYPE, FLIP_TRANSFORM_TYPE>(moving_image, mirror, schedule.number_of_threads, INTERPOLATE_NEAREST);
+    }
+
+    IMAGE_PYRAMID_TYPE moving_pyramids[2];
+    vector<CandidateType> candidates;
+    for (unsigned int orientation = 0; orientation < number_of_orientations; orientation++) {
+        moving_pyramids[orientation] = build_image_pyramid<TYPES>(oriented_images[orientation], schedule, false, schedule.number_of_threads);
+
+        // The center of mass is the same for every angle
+        typename RIGID_TRANSFORM_TYPE::Pointer centered_transform = initialize_rigid_transform<TYPES>(fixed_image, oriented_images[orientation]);
+        for (size_t i = 0; i < settings.rigid_start_angles.size(); i++) {
+            CandidateType candidate;
+            candidate.transform = RIGID_TRANSFORM_TYPE::New();
+            candidate.transform->SetFixedParameters(centered_transform->GetFixedParameters());
+            candidate.transform->SetParameters(centered_transform->GetParameters());
+            set_rigid_rotation(candidate.transform.GetPointer(), settings.rigid_start_angles[i] * M_PI / 180.0);
+            candidate.flipped = orientation == 1;
+            candidate.metric_value = numeric_limits<double>::max();
+            candidates.push_back(candidate);
+        }
+    }
+
+    // Compare the starts on the coarsest level, several at a time, sharing the stage's threads between them
+    const unsigned int stage_threads = schedule.number_of_threads > 0 ? schedule.number_of_threads : max(thread::hardware_concurrency(), 1u);
+    const size_t number_of_workers = min<size_t>(candidates.size(), stage_threads);
+    PyramidSchedule candidate_schedule = schedule;
+    candidate_schedule.number_of_threads = max<unsigned int>(stage_threads / number_of_workers, 1);
+
+    // Registrations write the requested region of their inputs, so each start gets its own views of the coarsest levels
+    vector<typename IMAGE_TYPE::Pointer> candidate_fixed_images;
+    vector<typename IMAGE_TYPE::Pointer> candidate_moving_images;
+    for (size_t i = 0; i < candidates.size(); i++) {
+        candidate_fixed_images.push_back(graft_image<IMAGE_TYPE>(fixed_pyramid[0]));
+        candidate_moving_images.push_back(graft_image<IMAGE_TYPE>(moving_pyramids[candidates[i].flipped][0]));
+    }
+
+    atomic<size_t> next_candidate(0);
+    auto optimize_candidates = [&]() {
+        for (size_t i = next_candidate++; i < candidates.size(); i = next_candidate++) {
+            try {
+                candidates[i].metric_value = optimize_rigid_transform<TYPES>(
+                    candidate_fixed_images[i], candidate_moving_images[i], candidates[i].transform, candidate_schedule, 0, false);
+            } catch (...) {
+                // A start that fails to optimize is never chosen
+                candidates[i].metric_value = numeric_limits<double>::max();
+            }
+        }
+    };
+
+    vector<thread> workers;
+    for (size_t i = 0; i < number_of_workers; i++) {
+        workers.push_back(thread(optimize_candidates));
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+
+    // Refine the best starts through the finer levels
+    sort(candidates.begin(), candidates.end());
+    const size_t number_to_refine = min<size_t>(candidates.size(), max(settings.rigid_starts_to_refine, 1u));
+    for (size_t i = 0; i < number_to_refine && fixed_pyramid.size() > 1; i++) {
+        cout << "Refining rigid start " << i << " (coarse metric " << candidates[i].metric_value
+             << (candidates[i].flipped ? ", flipped" : "") << ")" << endl;
+        candidates[i].metric_value = optimize_rigid_transform<TYPES>(
+            fixed_pyramid, moving_pyramids[candidates[i].flipped], candidates[i].transform, schedule, 1, true);
+    }
+
+    CandidateType best = *min_element(candidates.begin(), candidates.begin() + number_to_refine);
+    if (best.flipped) {
+        flip_transform = mirror;
+    }
+    return best.transform;
+}
+
+
+template<typename TYPES>
+typename TYPES::FLIP_TRANSFORM_TYPE::Pointer create_flip_transform(typename TYPES::IMAGE_TYPE::Pointer image) {
+    // Returns the transform that mirrors image left to right about its center
+    // Pixel centers map onto pixel centers, so resampling through it does not interpolate
+    typedef typename TYPES::IMAGE_TYPE IMAGE_TYPE;
+    typedef typename TYPES::FLIP_TRANSFORM_TYPE FLIP_TRANSFORM_TYPE;
+    typename FLIP_TRANSFORM_TYPE::Pointer flip_transform = FLIP_TRANSFORM_TYPE::New();
+
+    typename IMAGE_TYPE::RegionType region = image->GetLargestPossibleRegion();
+    itk::ContinuousIndex<double, TYPES::Dimensions> center_index;
+    for (unsigned int i = 0; i < TYPES::Dimensions; i++) {
+        center_index[i] = region.GetIndex()[i] + (region.GetSize()[i] - 1) / 2.0;
+    }
+    typename IMAGE_TYPE::PointType center;
+    image->TransformContinuousIndexToPhysicalPoint(center_index, center);
+    flip_transform->SetCenter(center);
+
+    // Mirror along the image's first axis, which may not be the first physical axis
+    typename FLIP_TRANSFORM_TYPE::MatrixType mirror;
+    mirror.SetIdentity();
+    mirror[0][0] = -1;
+    typename FLIP_TRANSFORM_TYPE::MatrixType direction = image->GetDirection();
+    flip_transform->SetMatrix(direction * mirror * typename FLIP_TRANSFORM_TYPE::MatrixType(direction.GetInverse()));
+    return flip_transform;
+}
+
+
+template<typename TYPES>
+typename TYPES::BSPLINE_TRANSFORM_TYPE::Pointer compute_bSpline_transform(typename TYPES::IMAGE_TYPE::Pointer fixed_image, typename TYPES::IMAGE_TYPE::Pointer moving_image){
+    PyramidSchedule schedule = get_bspline_pyramid_schedule(TYPES::Dimensions);
+    typename TYPES::IMAGE_PYRAMID_TYPE fixed_pyramid = build_image_pyramid<TYPES>(fixed_image, schedule, true, schedule.number_of_threads);
+    return compute_bSpline_transform<TYPES>(fixed_pyramid, moving_image, schedule);
+}
+
+
+template<typename TYPES>
+typename TYPES::BSPLINE_TRANSFORM_TYPE::Pointer compute_bSpline_transform(const typename TYPES::IMAGE_PYRAMID_TYPE& fixed_pyramid, typename TYPES::IMAGE_TYPE::Pointer moving_image, const PyramidSchedule& schedule, typename TYPES::COMPOSITE_TRANSFORM_TYPE::Pointer moving_initial_transform){
+    // Registers moving_image to the fixed image, whose pyramid was built from schedule with build_image_pyramid
+    // The fixed pyramid is only read, so one pyramid can be shared by registrations running at the same time
+    // moving_initial_transform, if given, is applied after the B-spline transform and held fixed,
+    //  so the moving image never has to be resampled through it before registration
+    typedef typename TYPES::IMAGE_TYPE IMAGE_TYPE;
+    typedef typename TYPES::IMAGE_PYRAMID_TYPE IMAGE_PYRAMID_TYPE;
+    typedef typename TYPES::BSPLINE_TRANSFORM_TYPE BSPLINE_TRANSFORM_TYPE;
     typedef itk::LBFGSBOptimizerv4 OptimizerType;
     typedef itk::MattesMutualInformationImageToImageMetricv4<IMAGE_TYPE, IMAGE_TYPE> MetricType;
     typedef itk::ImageRegistrationMethodv4<IMAGE_TYPE, IMAGE_TYPE, BSPLINE_TRANSFORM_TYPE> RegistrationType;
     typedef itk::BSplineTransformInitializer<BSPLINE_TRANSFORM_TYPE, IMAGE_TYPE> BSplineTransformInitializerType;
+    typedef itk::BSplineTransformParametersAdaptor<BSPLINE_TRANSFORM_TYPE> BSplineTransformAdaptorType;
 
-    // Instantiate the metric, optimizer, interpolator, transform and registration objects
-    MetricType::Pointer metric = MetricType::New();
-    OptimizerType::Pointer optimizer = OptimizerType::New();
-    RegistrationType::Pointer registration = RegistrationType::New();
-    BSPLINE_TRANSFORM_TYPE::Pointer transform = BSPLINE_TRANSFORM_TYPE::New();
-    BSplineTransformInitializerType::Pointer transform_initializer = BSplineTransformInitializerType::New();
+    // Instantiate the transform
+    typename IMAGE_TYPE::Pointer fixed_image = fixed_pyramid.back();
+    typename BSPLINE_TRANSFORM_TYPE::Pointer transform = BSPLINE_TRANSFORM_TYPE::New();
+    typename BSplineTransformInitializerType::Pointer transform_initializer = BSplineTransformInitializerType::New();
 
-    // Calculate image physical dimensions and mesh_size
-    BSPLINE_TRANSFORM_TYPE::PhysicalDimensionsType fixed_image_physical_dimensions;
-    BSPLINE_TRANSFORM_TYPE::MeshSizeType mesh_size;
-    IMAGE_TYPE::SizeType fixed_image_size = fixed_image->GetLargestPossibleRegion().GetSize();
-    unsigned int number_of_grid_nodes_in_one_dimension = 8;
+    // Start from the mesh of the coarsest level
+    typename BSPLINE_TRANSFORM_TYPE::MeshSizeType mesh_size;
+    mesh_size.Fill(schedule.mesh_sizes[0]);
 
-    for (int i = 0; i < 2; i++) {
-        fixed_image_physical_dimensions[i] =  (fixed_image_size[i] - 1) * fixed_image->GetSpacing()[i];
-    }
-    mesh_size.Fill(number_of_grid_nodes_in_one_dimension - BSPLINE_ORDER);
-
-    // Initialize the transform
+    // Initialize the transform over the domain of the fixed image
     transform_initializer->SetTransform(transform);
     transform_initializer->SetImage(fixed_image);
     transform_initializer->SetTransformDomainMeshSize(mesh_size);
@@ -267,64 +747,499 @@ BSPLINE_TRANSFORM_TYPE::Pointer compute_bSpline_transform(IMAGE_TYPE::Pointer fi
 
     transform->SetIdentity();
 
-    // Set Metic Parameters
-    metric->SetNumberOfHistogramBins(64);
+    // Set Multi-Resolution Options
+    // The shrink factor denotes to the factor by which the image will be downsized
+    // The smoothing sigma determines the width of the gaussian kernel used to smooth the downsampled image
+    // Like the registration method's own pyramid, the moving image is only smoothed, not shrunk,
+    //  and the metric samples it at the pixels of the shrunk fixed image
+    IMAGE_PYRAMID_TYPE moving_pyramid = build_image_pyramid<TYPES>(moving_image, schedule, false, schedule.number_of_threads);
+
+    // Each level is registered on its own, continuing from the transform of the previous level
+    for (unsigned int level = 0; level < fixed_pyramid.size(); level++) {
+        cout << "Level " << level << ", shrink factor " << schedule.shrink_factors[level]
+             << ", mesh size " << schedule.mesh_sizes[level] << endl;
+
+        // Refine the mesh, upsampling the coefficients found so far onto it
+        if (schedule.mesh_sizes[level] != mesh_size[0]) {
+            mesh_size.Fill(schedule.mesh_sizes[level]);
+            typename BSplineTransformAdaptorType::Pointer transform_adaptor = BSplineTransformAdaptorType::New();
+            transform_adaptor->SetTransform(transform);
+            transform_adaptor->SetRequiredTransformDomainOrigin(transform->GetTransformDomainOrigin());
+            transform_adaptor->SetRequiredTransformDomainDirection(transform->GetTransformDomainDirection());
+            transform_adaptor->SetRequiredTransformDomainPhysicalDimensions(transform->GetTransformDomainPhysicalDimensions());
+            transform_adaptor->SetRequiredTransformDomainMeshSize(mesh_size);
+            transform_adaptor->AdaptTransformParameters();
+        }
+        const unsigned int num_params = transform->GetNumberOfParameters();
+
+        // Instantiate the metric, optimizer and registration objects
+        typename MetricType::Pointer metric = MetricType::New();
+        OptimizerType::Pointer optimizer = OptimizerType::New();
+        typename RegistrationType::Pointer registration = RegistrationType::New();
+
+        // Set Metic Parameters
+        metric->SetNumberOfHistogramBins(64);
+
+        // Specify the optimizer parameters
+        configure_optimizer(optimizer, num_params, schedule.iterations[level]);
+
+        // Add an observer to the optimizer
+        BsplineTransformIterationUpdater::Pointer observer = BsplineTransformIterationUpdater::New();
+        optimizer->AddObserver(itk::IterationEvent(), observer);
+
+        // Connect everything to the registration object
+        registration->SetMetric(metric);
+        registration->SetOptimizer(optimizer);
+        registration->SetInitialTransform(transform);
+        registration->InPlaceOn();
+        if (moving_initial_transform) {
+            registration->SetMovingInitialTransform(moving_initial_transform);
+        }
 
-    // Specify the optimizer parameters
-    const unsigned int num_params = transform->GetNumberOfParameters();
-    configure_optimizer(optimizer, num_params);
+        // Set the inputs for the registration object, which are already smoothed and shrunk
+        registration->SetFixedImage(fixed_pyramid[level]);
+        registration->SetMovingImage(moving_pyramid[level]);
 
-    // Add an observer to the optimizer
-    BsplineTransformIterationUpdater::Pointer observer = BsplineTransformIterationUpdater::New();
-    optimizer->AddObserver(itk::IterationEvent(), observer);
+        typename RegistrationType::ShrinkFactorsArrayType shrink_factor_per_level;
+        shrink_factor_per_level.SetSize(1);
+        shrink_factor_per_level[0] = 1;
 
-    // Connect everything to the registration object
-    registration->SetMetric(metric);
-    registration->SetOptimizer(optimizer);
-    registration->SetInitialTransform(transform);
+        typename RegistrationType::SmoothingSigmasArrayType sigma_per_level;
+        sigma_per_level.SetSize(1);
+        sigma_per_level[0] = 0;
 
-    // Set the inputs for the registration object
-    registration->SetFixedImage(fixed_image);
-    registration->SetMovingImage(moving_image);
+        registration->SetNumberOfLevels(1);
+        registration->SetShrinkFactorsPerLevel(shrink_factor_per_level);
+        registration->SetSmoothingSigmasPerLevel(sigma_per_level);
+        configure_metric_sampling<RegistrationType>(registration, schedule, level);
+        configure_registration_threads<RegistrationType, MetricType>(registration, metric, optimizer, schedule.number_of_threads);
 
-    // Set Multi-Resolution Options
-    // The shrink factor denotes to the factor by which the image will be downsized
-    // The smoothing sigma determines the width of the gaussian kernel used to smooth the downsampled image
-    const unsigned int number_of_levels = 3;
+        // Start Registration
+        run_registration_level<RegistrationType, BSPLINE_TRANSFORM_TYPE>(registration, optimizer, transform, schedule.early_stopping, true);
+    }
 
-    RegistrationType::ShrinkFactorsArrayType shrink_factor_per_level;
-    shrink_factor_per_level.SetSize(number_of_levels);
-    shrink_factor_per_level[0] = 4;
-    shrink_factor_per_level[1] = 2;
-    shrink_factor_per_level[2] = 1;
+    return transform;
+}
 
-    RegistrationType::SmoothingSigmasArrayType sigma_per_level;
-    sigma_per_level.SetSize(number_of_levels);
-    sigma_per_level[0] = 4;
-    sigma_per_level[1] = 2;
-    sigma_per_level[2] = 0;
 
-    registration->SetNumberOfLevels(number_of_levels);
-    registration->SetShrinkFactorsPerLevel(shrink_factor_per_level);
-    registration->SetSmoothingSigmasPerLevel(sigma_per_level);
+RegistrationSettings get_default_registration_settings(unsigned int dimensions) {
+    // By default the rigid stage starts once, from an angle of zero
+    RegistrationSettings settings;
+    settings.rigid_schedule = get_rigid_pyramid_schedule(dimensions);
+    settings.bspline_schedule = get_bspline_pyramid_schedule(dimensions);
+    settings.rigid_start_angles.assign(1, 0.0);
+    settings.rigid_try_flips = false;
+    settings.rigid_starts_to_refine = 1;
+    settings.io_threads = 0;
+    settings.resample_threads = 0;
+    settings.apply_targets_in_flight = 2;
+    settings.apply_memory_limit = 0;
+    settings.interpolation = INTERPOLATE_BSPLINE;
+    return settings;
+}
 
-    // Start Registration
-    try {
-        registration->Update();
 
-        cout << "Optimizer stop condition = "
-                  << registration->GetOptimizer()->GetStopConditionDescription()
-                  << endl;
-    } catch ( itk::ExceptionObject & err ) {
-        cerr << "ExceptionObject caught !" << endl;
-        cerr << err << endl;
-        throw -1;
+RegistrationSettings get_registration_settings(option::Option* options, unsigned int dimensions) {
+    // Returns the default settings for images with dimensions dimensions, overridden by any given on the command line
+    RegistrationSettings settings = get_default_registration_settings(dimensions);
+    if (options[RIGID_START_ANGLES]) {
+        vector<string> angles = split(options[RIGID_START_ANGLES].arg, ',');
+        settings.rigid_start_angles.clear();
+        for (size_t i = 0; i < angles.size(); i++) {
+            settings.rigid_start_angles.push_back(atof(angles[i].c_str()));
+        }
+    }
+    settings.rigid_try_flips = options[RIGID_TRY_FLIPS];
+    settings.rigid_schedule = parse_pyramid_schedule(
+        options[RIGID_SHRINK_FACTORS] ? options[RIGID_SHRINK_FACTORS].arg : NULL,
+        options[RIGID_SMOOTHING_SIGMAS] ? options[RIGID_SMOOTHING_SIGMAS].arg : NULL,
+        options[RIGID_ITERATIONS] ? options[RIGID_ITERATIONS].arg : NULL,
+        options[RIGID_SAMPLING] ? options[RIGID_SAMPLING].arg : NULL,
+        settings.rigid_schedule);
+    settings.bspline_schedule = parse_pyramid_schedule(NULL, NULL, NULL,
+        options[BSPLINE_SAMPLING] ? options[BSPLINE_SAMPLING].arg : NULL,
+        settings.bspline_schedule);
+    if (options[MESH_SCHEDULE]) {
+        settings.bspline_schedule.mesh_sizes = parse_mesh_schedule(options[MESH_SCHEDULE].arg, settings.bspline_schedule.shrink_factors.size());
     }
 
-    return transform;
+    // Concurrent batch jobs split the thread budget between them, and each job gives its share to every stage
+    // Without --threads a batch shares every available cpu, while a single registration is left at ITK's default
+    if (options[THREADS] || options[BATCH_FILE]) {
+        const unsigned int total_threads = options[THREADS] ? parse_thread_count(options[THREADS].arg) : get_available_cpus();
+        const unsigned int concurrent_jobs = options[BATCH_FILE] && options[CONCURRENT_JOBS] ? max(atoi(options[CONCURRENT_JOBS].arg), 1) : 1;
+        const unsigned int job_threads = max(total_threads / concurrent_jobs, 1u);
+        settings.io_threads = job_threads;
+        settings.rigid_schedule.number_of_threads = job_threads;
+        settings.bspline_schedule.number_of_threads = job_threads;
+        settings.resample_threads = job_threads;
+    }
+    if (options[STAGE_THREADS]) {
+        vector<string> stage_threads = split(options[STAGE_THREADS].arg, ',');
+        if (stage_threads.size() != 4) {
+            throw invalid_argument("--stage_threads needs a thread count for each of io, rigid, bspline and resample");
+        }
+        settings.io_threads = parse_thread_count(stage_threads[0]);
+        settings.rigid_schedule.number_of_threads = parse_thread_count(stage_threads[1]);
+        settings.bspline_schedule.number_of_threads = parse_thread_count(stage_threads[2]);
+        settings.resample_threads = parse_thread_count(stage_threads[3]);
+    }
+
+    // The shrink, smoothing and gradient filters a registration creates internally take ITK's global default,
+    //  so it is set to the largest stage budget
+    const unsigned int largest_stage_threads = max(max(settings.io_threads, settings.resample_threads),
+        max(settings.rigid_schedule.number_of_threads, settings.bspline_schedule.number_of_threads));
+    if (largest_stage_threads > 0) {
+        itk::MultiThreader::SetGlobalDefaultNumberOfThreads(largest_stage_threads);
+    }
+
+    // Both stages sample the same way
+    MetricSampling sampling = settings.rigid_schedule.sampling;
+    if (options[SAMPLING_STRATEGY]) {
+        sampling.strategy = parse_sampling_strategy(options[SAMPLING_STRATEGY].arg);
+    }
+    if (options[SAMPLING_SEED]) {
+        sampling.seed = atoi(options[SAMPLING_SEED].arg);
+    }
+    settings.rigid_schedule.sampling = sampling;
+    settings.bspline_schedule.sampling = sampling;
+
+    EarlyStopping early_stopping = settings.rigid_schedule.early_stopping;
+    if (options[PLATEAU_WINDOW]) {
+        early_stopping.window = max(atoi(options[PLATEAU_WINDOW].arg), 1);
+    }
+    if (options[PLATEAU_THRESHOLD]) {
+        early_stopping.threshold = atof(options[PLATEAU_THRESHOLD].arg);
+    }
+    settings.rigid_schedule.early_stopping = early_stopping;
+    settings.bspline_schedule.early_stopping = early_stopping;
+    if (options[RIGID_STARTS_TO_REFINE]) {
+        settings.rigid_starts_to_refine = atoi(options[RIGID_STARTS_TO_REFINE].arg);
+    }
+    if (options[INTERPOLATION]) {
+        settings.interpolation = parse_interpolation_method(options[INTERPOLATION].arg);
+    }
+    if (options[APPLY_IN_FLIGHT]) {
+        settings.apply_targets_in_flight = max(atoi(options[APPLY_IN_FLIGHT].arg), 1);
+    }
+    if (options[APPLY_MEMORY]) {
+        settings.apply_memory_limit = static_cast<size_t>(max(atol(options[APPLY_MEMORY].arg), 0L)) << 20;
+    }
+    return settings;
+}
+
+
+PyramidSchedule get_rigid_pyramid_schedule(unsigned int dimensions) {
+    // The rigid stage spends most of its iterations at a quarter resolution, on 1/16 of the pixels
+    // A volume has far more voxels for the same resolution, so it starts at an eighth, never reaches full resolution,
+    //  and samples a random subset of the voxels at every level
+    PyramidSchedule schedule;
+    const unsigned int shrink_factors[] = {4, 2, 1};
+    const double smoothing_sigmas[] = {2, 1, 0};
+    const unsigned int volume_shrink_factors[] = {8, 4, 2};
+    const double volume_smoothing_sigmas[] = {4, 2, 1};
+    const double volume_sampling_percentages[] = {50, 25, 10};
+    const unsigned int iterations[] = {200, 100, 50};
+    if (dimensions > 2) {
+        schedule.shrink_factors.assign(volume_shrink_factors, volume_shrink_factors + 3);
+        schedule.smoothing_sigmas.assign(volume_smoothing_sigmas, volume_smoothing_sigmas + 3);
+        schedule.sampling_percentages.assign(volume_sampling_percentages, volume_sampling_percentages + 3);
+        schedule.sampling.strategy = SAMPLE_RANDOM;
+    } else {
+        schedule.shrink_factors.assign(shrink_factors, shrink_factors + 3);
+        schedule.smoothing_sigmas.assign(smoothing_sigmas, smoothing_sigmas + 3);
+        schedule.sampling_percentages.assign(3, 100.0);
+        schedule.sampling.strategy = SAMPLE_NONE;
+    }
+    schedule.iterations.assign(iterations, iterations + 3);
+    schedule.sampling.seed = 1;
+    schedule.early_stopping.window = 10;
+    schedule.early_stopping.threshold = 1e-5;
+    schedule.number_of_threads = 0;
+    return schedule;
+}
+
+
+PyramidSchedule get_bspline_pyramid_schedule(unsigned int dimensions) {
+    // The B-spline stage registers at a quarter, half and full resolution
+    // A volume's transform has a control point per mesh node in every dimension, so it gets fewer iterations,
+    //  and the metric samples a random subset of the voxels
+    PyramidSchedule schedule;
+    const unsigned int shrink_factors[] = {4, 2, 1};
+    const double smoothing_sigmas[] = {4, 2, 0};
+    const unsigned int volume_iterations[] = {100, 100, 50};
+    const double volume_sampling_percentages[] = {25, 10, 5};
+    schedule.shrink_factors.assign(shrink_factors, shrink_factors + 3);
+    schedule.smoothing_sigmas.assign(smoothing_sigmas, smoothing_sigmas + 3);
+    schedule.mesh_sizes.assign(3, 8 - BSPLINE_ORDER);
+    if (dimensions > 2) {
+        schedule.iterations.assign(volume_iterations, volume_iterations + 3);
+        schedule.sampling_percentages.assign(volume_sampling_percentages, volume_sampling_percentages + 3);
+        schedule.sampling.strategy = SAMPLE_RANDOM;
+    } else {
+        schedule.iterations.assign(3, 200);
+        schedule.sampling_percentages.assign(3, 100.0);
+        schedule.sampling.strategy = SAMPLE_NONE;
+    }
+    schedule.sampling.seed = 1;
+    schedule.early_stopping.window = 10;
+    schedule.early_stopping.threshold = 1e-5;
+    schedule.number_of_threads = 0;
+    return schedule;
+}
+
+
+PyramidSchedule parse_pyramid_schedule(const char* shrink_factors, const char* smoothing_sigmas, const char* iterations, const char* sampling_percentages, const PyramidSchedule& defaults) {
+    // Parses comma separated per-level lists, any of which may be NULL to keep the defaults
+    // Throws std::invalid_argument if the lists disagree on the number of levels
+    PyramidSchedule schedule = defaults;
+    if (shrink_factors) {
+        vector<string> values = split(shrink_factors, ',');
+        schedule.shrink_factors.clear();
+        for (size_t i = 0; i < values.size(); i++) {
+            schedule.shrink_factors.push_back(max(atoi(values[i].c_str()), 1));
+        }
+    }
+    if (smoothing_sigmas) {
+        vector<string> values = split(smoothing_sigmas, ',');
+        schedule.smoothing_sigmas.clear();
+        for (size_t i = 0; i < values.size(); i++) {
+            schedule.smoothing_sigmas.push_back(atof(values[i].c_str()));
+        }
+    }
+    if (iterations) {
+        vector<string> values = split(iterations, ',');
+        schedule.iterations.clear();
+        for (size_t i = 0; i < values.size(); i++) {
+            schedule.iterations.push_back(max(atoi(values[i].c_str()), 1));
+        }
+    }
+    if (sampling_percentages) {
+        vector<string> values = split(sampling_percentages, ',');
+        schedule.sampling_percentages.clear();
+        for (size_t i = 0; i < values.size(); i++) {
+            const double percentage = atof(values[i].c_str());
+            if (percentage <= 0 || percentage > 100) {
+                throw invalid_argument("Sampling percentages must be greater than 0 and at most 100, got " + values[i]);
+            }
+            schedule.sampling_percentages.push_back(percentage);
+        }
+    } else if (!schedule.shrink_factors.empty()) {
+        // The default percentages follow the number of levels, extra levels sample like the finest default level
+        schedule.sampling_percentages.resize(schedule.shrink_factors.size(),
+            schedule.sampling_percentages.empty() ? 100.0 : schedule.sampling_percentages.back());
+    }
+
+    if (schedule.shrink_factors.empty()
+            || schedule.smoothing_sigmas.size() != schedule.shrink_factors.size()
+            || schedule.iterations.size() != schedule.shrink_factors.size()
+            || schedule.sampling_percentages.size() != schedule.shrink_factors.size()) {
+        throw invalid_argument("Every pyramid level needs a shrink factor, a smoothing sigma, an iteration budget and a sampling percentage");
+    }
+    return schedule;
+}
+
+
+SamplingStrategy parse_sampling_strategy(const string& strategy) {
+    if (strategy == "none") {
+        return SAMPLE_NONE;
+    } else if (strategy == "regular") {
+        return SAMPLE_REGULAR;
+    } else if (strategy == "random") {
+        return SAMPLE_RANDOM;
+    }
+    throw invalid_argument("Unknown sampling strategy '" + strategy + "', expected none, regular or random");
+}
+
+
+vector<unsigned int> parse_mesh_schedule(const string& mesh_schedule, unsigned int number_of_levels) {
+    // Parses one mesh size per level, or a single size for the coarsest level that doubles at each finer level
+    // Throws std::invalid_argument for sizes below 1 or the wrong number of levels
+    vector<string> values = split(mesh_schedule, ',');
+    vector<unsigned int> mesh_sizes;
+    for (size_t i = 0; i < values.size(); i++) {
+        const int mesh_size = atoi(values[i].c_str());
+        if (mesh_size < 1) {
+            throw invalid_argument("Mesh sizes must be at least 1, got '" + values[i] + "'");
+        }
+        mesh_sizes.push_back(mesh_size);
+    }
+
+    if (mesh_sizes.size() == 1) {
+        while (mesh_sizes.size() < number_of_levels) {
+            mesh_sizes.push_back(mesh_sizes.back() * 2);
+        }
+    }
+    if (mesh_sizes.size() != number_of_levels) {
+        throw invalid_argument("The mesh schedule needs one mesh size per B-spline level");
+    }
+    return mesh_sizes;
+}
+
+
+const char* get_sampling_strategy_name(SamplingStrategy strategy) {
+    switch (strategy) {
+        case SAMPLE_REGULAR:
+            return "regular";
+        case SAMPLE_RANDOM:
+            return "random";
+        default:
+            return "none";
+    }
+}
+
+
+template<typename TYPES>
+typename TYPES::IMAGE_PYRAMID_TYPE build_image_pyramid(typename TYPES::IMAGE_TYPE::Pointer image, const PyramidSchedule& schedule, bool shrink, unsigned int number_of_threads) {
+    // Returns image smoothed, and optionally shrunk, for each level of schedule
+    // The filters use number_of_threads threads, or ITK's global default for 0
+    // The levels are disconnected from their filters, so that they can be shared between threads
+    typedef typename TYPES::IMAGE_TYPE IMAGE_TYPE;
+    typedef itk::SmoothingRecursiveGaussianImageFilter<IMAGE_TYPE, IMAGE_TYPE> SmoothingFilterType;
+    typedef itk::ShrinkImageFilter<IMAGE_TYPE, IMAGE_TYPE> ShrinkFilterType;
+
+    typename TYPES::IMAGE_PYRAMID_TYPE pyramid;
+    for (unsigned int level = 0; level < schedule.shrink_factors.size(); level++) {
+        typename IMAGE_TYPE::Pointer level_image = image;
+
+        if (schedule.smoothing_sigmas[level] > 0) {
+            typename SmoothingFilterType::Pointer smoothing_filter = SmoothingFilterType::New();
+            smoothing_filter->SetInput(level_image);
+            smoothing_filter->SetSigma(schedule.smoothing_sigmas[level]);
+            if (number_of_threads > 0) {
+                smoothing_filter->SetNumberOfThreads(number_of_threads);
+            }
+            smoothing_filter->Update();
+            level_image = smoothing_filter->GetOutput();
+            level_image->DisconnectPipeline();
+        }
+
+        if (shrink && schedule.shrink_factors[level] > 1) {
+            typename ShrinkFilterType::Pointer shrink_filter = ShrinkFilterType::New();
+            shrink_filter->SetInput(level_image);
+            shrink_filter->SetShrinkFactors(schedule.shrink_factors[level]);
+            if (number_of_threads > 0) {
+                shrink_filter->SetNumberOfThreads(number_of_threads);
+            }
+            shrink_filter->Update();
+            level_image = shrink_filter->GetOutput();
+            level_image->DisconnectPipeline();
+        }
+
+        pyramid.push_back(level_image);
+    }
+    return pyramid;
+}
+
+
+template<typename TYPES>
+typename TYPES::IMAGE_PYRAMID_TYPE graft_image_pyramid(const typename TYPES::IMAGE_PYRAMID_TYPE& pyramid) {
+    // Returns views of the levels of pyramid that share their pixels, for a registration running on another thread
+    // Registrations write the requested region of their inputs, so concurrent registrations never share a level
+    typename TYPES::IMAGE_PYRAMID_TYPE views;
+    for (size_t level = 0; level < pyramid.size(); level++) {
+        views.push_back(graft_image<typename TYPES::IMAGE_TYPE>(pyramid[level]));
+    }
+    return views;
 }
 
-void configure_optimizer(itk::LBFGSBOptimizerv4::Pointer optimizer, unsigned int num_params) {
+
+template<typename TYPES>
+RegistrationResult<TYPES> register_moving_image(typename TYPES::IMAGE_TYPE::Pointer fixed_image, const typename TYPES::IMAGE_PYRAMID_TYPE& fixed_rigid_pyramid, const typename TYPES::IMAGE_PYRAMID_TYPE& fixed_bspline_pyramid, const RegistrationSettings& settings, typename TYPES::IMAGE_TYPE::Pointer moving_image) {
+    // Registers moving_image to fixed_image with a rigid, then a B-spline transform
+    // The fixed pyramids were built from the rigid and B-spline schedules of settings
+    RegistrationResult<TYPES> result;
+    // The B-spline stage registers through the rigid stage's transform, and the output is resampled once
+    //  through the composition of both
+    result.rigid_transform = compute_multistart_rigid_transform<TYPES>(fixed_image, fixed_rigid_pyramid, moving_image, settings, result.flip_transform);
+    result.bspline_transform = compute_bSpline_transform<TYPES>(fixed_bspline_pyramid, moving_image, settings.bspline_schedule, get_rigid_stage_transform<TYPES>(result));
+    result.output_image = apply_transform<typename TYPES::IMAGE_TYPE, typename TYPES::COMPOSITE_TRANSFORM_TYPE>(
+        moving_image, get_resampling_transform<TYPES>(result), settings.resample_threads, settings.interpolation);
+    return result;
+}
+
+
+vector<RegistrationJob> read_batch_file(const char* batch_path) {
+    // Reads one moving_path,output_path[,transform_path] job per line, skipping blank lines
+    vector<RegistrationJob> jobs;
+    ifstream batch_file(batch_path);
+    string line;
+    while (getline(batch_file, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        vector<string> paths = split(line, ',');
+        if (paths.size() < 2) {
+            cerr << "Skipping batch line without an output path: " << line << endl;
+            continue;
+        }
+
+        RegistrationJob job;
+        job.moving_path = paths[0];
+        job.output_path = paths[1];
+        job.transform_path = paths.size() > 2 ? paths[2] : "";
+        jobs.push_back(job);
+    }
+    return jobs;
+}
+
+
+template<typename TYPES>
+void register_batch(typename TYPES::IMAGE_TYPE::Pointer fixed_image, const vector<RegistrationJob>& jobs, const RegistrationSettings& settings, unsigned int number_of_concurrent_jobs) {
+    // Registers every job's moving image to fixed_image, number_of_concurrent_jobs at a time
+    // The fixed image and its pyramids are prepared once, and their pixels are shared by every job
+    // Filters and registrations still write the requested region of their inputs, and update the source of an input
+    //  that has one, so fixed_image is disconnected from its reader and each job works on its own grafted views
+    typedef typename TYPES::IMAGE_TYPE IMAGE_TYPE;
+    typedef typename TYPES::IMAGE_PYRAMID_TYPE IMAGE_PYRAMID_TYPE;
+    fixed_image->DisconnectPipeline();
+    IMAGE_PYRAMID_TYPE fixed_rigid_pyramid = build_image_pyramid<TYPES>(fixed_image, settings.rigid_schedule, true, settings.io_threads);
+    IMAGE_PYRAMID_TYPE fixed_bspline_pyramid = build_image_pyramid<TYPES>(fixed_image, settings.bspline_schedule, true, settings.io_threads);
+
+    atomic<size_t> next_job(0);
+    atomic<size_t> failed_jobs(0);
+    mutex report_mutex;
+
+    auto run_jobs = [&]() {
+        for (size_t i = next_job++; i < jobs.size(); i = next_job++) {
+            try {
+                if (read_image_dimension(jobs[i].moving_path.c_str()) != TYPES::Dimensions) {
+                    throw runtime_error("The moving image must have as many dimensions as the fixed image");
+                }
+                typename IMAGE_TYPE::Pointer moving_image = load_image<IMAGE_TYPE>(jobs[i].moving_path.c_str());
+                RegistrationResult<TYPES> result = register_moving_image<TYPES>(
+                    graft_image<IMAGE_TYPE>(fixed_image), graft_image_pyramid<TYPES>(fixed_rigid_pyramid),
+                    graft_image_pyramid<TYPES>(fixed_bspline_pyramid), settings, moving_image);
+                write_image<IMAGE_TYPE>(result.output_image, jobs[i].output_path.c_str());
+                if (!jobs[i].transform_path.empty()) {
+                    write_registration_transform<TYPES>(result, settings, jobs[i].transform_path.c_str());
+                }
+            } catch (exception & err) {
+                lock_guard<mutex> lock(report_mutex);
+                cerr << "Registration of " << jobs[i].moving_path << " failed: " << err.what() << endl;
+                failed_jobs++;
+            } catch (...) {
+                // A failed registration should not stop the rest of the batch
+                lock_guard<mutex> lock(report_mutex);
+                cerr << "Registration of " << jobs[i].moving_path << " failed" << endl;
+                failed_jobs++;
+            }
+        }
+    };
+
+    vector<thread> workers;
+    for (unsigned int i = 0; i < max(number_of_concurrent_jobs, 1u); i++) {
+        workers.push_back(thread(run_jobs));
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+
+    cout << jobs.size() - failed_jobs << " of " << jobs.size() << " registrations succeeded" << endl;
+}
+
+
+void configure_optimizer(itk::LBFGSBOptimizerv4::Pointer optimizer, unsigned int num_params, unsigned int iterations) {
     typedef itk::LBFGSBOptimizerv4 OptimizerType;
     OptimizerType::BoundSelectionType boundSelect(num_params);
     OptimizerType::BoundValueType upperBound(num_params);
@@ -340,17 +1255,289 @@ void configure_optimizer(itk::LBFGSBOptimizerv4::Pointer optimizer, unsigned int
 
     optimizer->SetCostFunctionConvergenceFactor(1.e7);
     optimizer->SetGradientConvergenceTolerance(1e-35);
-    optimizer->SetNumberOfIterations(200);
-    optimizer->SetMaximumNumberOfFunctionEvaluations(200);
+    optimizer->SetNumberOfIterations(iterations);
+    optimizer->SetMaximumNumberOfFunctionEvaluations(iterations);
     optimizer->SetMaximumNumberOfCorrections(7);
 }
 
 
-COMPOSITE_TRANSFORM_TYPE::Pointer compose_transforms(RIGID_TRANSFORM_TYPE::Pointer rigid_transform, BSPLINE_TRANSFORM_TYPE::Pointer bspline_transform) {
+template<typename TYPES>
+typename TYPES::COMPOSITE_TRANSFORM_TYPE::Pointer compose_transforms(typename TYPES::RIGID_TRANSFORM_TYPE::Pointer rigid_transform, typename TYPES::BSPLINE_TRANSFORM_TYPE::Pointer bspline_transform) {
+    typedef typename TYPES::COMPOSITE_TRANSFORM_TYPE COMPOSITE_TRANSFORM_TYPE;
     typedef itk::TransformFileWriterTemplate<double> TransformWriterType;
 
-    COMPOSITE_TRANSFORM_TYPE::Pointer composite_transform = COMPOSITE_TRANSFORM_TYPE::New();
+    typename COMPOSITE_TRANSFORM_TYPE::Pointer composite_transform = COMPOSITE_TRANSFORM_TYPE::New();
     composite_transform->AddTransform(rigid_transform);
     composite_transform->AddTransform(bspline_transform);
     return composite_transform;
 }
+
+
+template<typename TYPES>
+typename TYPES::COMPOSITE_TRANSFORM_TYPE::Pointer compose_transforms(const RegistrationResult<TYPES>& result) {
+    // Composes every transform of a registration, including the flip of the moving image if there was one
+    typename TYPES::COMPOSITE_TRANSFORM_TYPE::Pointer composite_transform = get_rigid_stage_transform<TYPES>(result);
+    composite_transform->AddTransform(result.bspline_transform);
+    return composite_transform;
+}
+
+
+template<typename TYPES>
+typename TYPES::COMPOSITE_TRANSFORM_TYPE::Pointer get_rigid_stage_transform(const RegistrationResult<TYPES>& result) {
+    // Returns the transform found by the rigid stage, which mirrors the moving image first if it was flipped
+    typename TYPES::COMPOSITE_TRANSFORM_TYPE::Pointer composite_transform = TYPES::COMPOSITE_TRANSFORM_TYPE::New();
+    if (result.flip_transform) {
+        composite_transform->AddTransform(result.flip_transform);
+    }
+    composite_transform->AddTransform(result.rigid_transform);
+    return composite_transform;
+}
+
+
+template<typename IMAGE_TYPE, typename TRANSFORM_TYPE>
+vector<typename IMAGE_TYPE::Pointer> warp_channels(const vector<typename IMAGE_TYPE::Pointer>& channels, typename TRANSFORM_TYPE::Pointer transform, const RegistrationSettings& settings) {
+    // Resamples images on one grid through transform, with the interpolation of settings
+    // Bspline interpolation warps every channel in one pass, the other interpolations are cheap enough to warp each alone
+    if (settings.interpolation == INTERPOLATE_BSPLINE) {
+        return apply_transform_to_channels<IMAGE_TYPE, TRANSFORM_TYPE>(channels, transform, settings.resample_threads);
+    }
+
+    vector<typename IMAGE_TYPE::Pointer> warped_channels;
+    for (size_t i = 0; i < channels.size(); i++) {
+        warped_channels.push_back(apply_transform<IMAGE_TYPE, TRANSFORM_TYPE>(channels[i], transform, settings.resample_threads, settings.interpolation));
+    }
+    return warped_channels;
+}
+
+
+template<typename TYPES>
+void apply_to_targets(const vector<vector<string> >& targets, typename TYPES::COMPOSITE_TRANSFORM_TYPE::Pointer resampling_transform, typename DisplacementFieldTypes<typename TYPES::IMAGE_TYPE>::FIELD_TYPE::Pointer displacement_field, const RegistrationSettings& settings) {
+    // Resamples each target's input_path,output_path through resampling_transform, or through displacement_field
+    //  when it covers the target's grid
+    // Targets on the same grid are warped together as one chunk, so each output pixel is transformed and weighted once
+    //  for all of them. With a memory limit, a grid's targets are split into chunks of at most a third of it, so that
+    //  a chunk can be read, one resampled and one written at once
+    // A reader, a resampler and a writer thread pass the chunks along bounded queues, so disk and cpu are busy at once.
+    //  settings limits the targets and the memory held between reading a chunk and writing it. A chunk with more
+    //  targets than that limit is only read once nothing else is in flight
+    typedef typename TYPES::IMAGE_TYPE IMAGE_TYPE;
+    typedef typename TYPES::COMPOSITE_TRANSFORM_TYPE COMPOSITE_TRANSFORM_TYPE;
+    typedef typename DisplacementFieldTypes<IMAGE_TYPE>::FIELD_TYPE FIELD_TYPE;
+    typedef typename DisplacementFieldTypes<IMAGE_TYPE>::FIELD_TRANSFORM_TYPE FIELD_TRANSFORM_TYPE;
+
+    struct TargetGroup {
+        vector<size_t> targets;
+        vector<typename IMAGE_TYPE::Pointer> images;
+        size_t bytes;
+    };
+
+    // Group the targets by grid, from their headers
+    vector<typename IMAGE_TYPE::Pointer> target_headers;
+    for (size_t i = 0; i < targets.size(); i++) {
+        target_headers.push_back(read_image_header<IMAGE_TYPE>(targets[i][0].c_str()));
+    }
+
+    vector<TargetGroup> groups;
+    vector<bool> grouped(targets.size(), false);
+    for (size_t i = 0; i < targets.size(); i++) {
+        if (grouped[i]) {
+            continue;
+        }
+        vector<size_t> grid_targets;
+        for (size_t j = i; j < targets.size(); j++) {
+            if (!grouped[j] && images_share_grid<IMAGE_TYPE, IMAGE_TYPE>(target_headers[i], target_headers[j])) {
+                grouped[j] = true;
+                grid_targets.push_back(j);
+            }
+        }
+
+        // Each target holds its input, its interleaved spline coefficients and its output, and a chunk holds
+        //  the coefficients of one channel on top of them
+        const size_t number_of_pixels = target_headers[i]->GetLargestPossibleRegion().GetNumberOfPixels();
+        const size_t target_bytes = number_of_pixels * (2 * sizeof(typename IMAGE_TYPE::PixelType) + sizeof(double));
+        const size_t chunk_bytes = number_of_pixels * sizeof(double);
+
+        size_t chunk_size = grid_targets.size();
+        if (settings.apply_memory_limit > 0) {
+            const size_t chunk_memory = settings.apply_memory_limit / 3;
+            chunk_size = chunk_memory > chunk_bytes ? max<size_t>((chunk_memory - chunk_bytes) / target_bytes, 1) : 1;
+        }
+
+        for (size_t first = 0; first < grid_targets.size(); first += chunk_size) {
+            TargetGroup group;
+            const size_t last = min(first + chunk_size, grid_targets.size());
+            group.targets.assign(grid_targets.begin() + first, grid_targets.begin() + last);
+            group.bytes = group.targets.size() * target_bytes + chunk_bytes;
+            groups.push_back(group);
+        }
+    }
+
+    typename FIELD_TRANSFORM_TYPE::Pointer field_transform;
+    if (displacement_field) {
+        field_transform = create_field_transform<IMAGE_TYPE>(displacement_field);
+    }
+
+    SharedBudget targets_in_flight(settings.apply_targets_in_flight);
+    SharedBudget memory_in_flight(settings.apply_memory_limit);
+    BoundedQueue<size_t> loaded_groups(settings.apply_targets_in_flight);
+    BoundedQueue<size_t> warped_groups(settings.apply_targets_in_flight);
+    exception_ptr error;
+    mutex error_mutex;
+
+    // Record the first failure, and stop every stage
+    auto fail = [&]() {
+        lock_guard<mutex> lock(error_mutex);
+        if (!error) {
+            error = current_exception();
+        }
+        targets_in_flight.close();
+        memory_in_flight.close();
+        loaded_groups.close();
+        warped_groups.close();
+    };
+
+    auto read_groups = [&]() {
+        try {
+            for (size_t i = 0; i < groups.size(); i++) {
+                if (!targets_in_flight.acquire(groups[i].targets.size()) || !memory_in_flight.acquire(groups[i].bytes)) {
+                    return;
+                }
+                for (size_t j = 0; j < groups[i].targets.size(); j++) {
+                    groups[i].images.push_back(load_image<IMAGE_TYPE>(targets[groups[i].targets[j]][0].c_str()));
+                }
+                if (!loaded_groups.push(i)) {
+                    return;
+                }
+            }
+            loaded_groups.close();
+        } catch (...) {
+            fail();
+        }
+    };
+
+    auto warp_groups = [&]() {
+        try {
+            size_t i;
+            while (loaded_groups.pop(i)) {
+                if (field_transform && field_covers_grid<IMAGE_TYPE, FIELD_TYPE>(displacement_field, groups[i].images[0])) {
+                    groups[i].images = warp_channels<IMAGE_TYPE, FIELD_TRANSFORM_TYPE>(groups[i].images, field_transform, settings);
+                } else {
+                    if (field_transform) {
+                        cout << targets[groups[i].targets[0]][0] << " is not on the grid of the displacement field, resampling through the transform" << endl;
+                    }
+                    groups[i].images = warp_channels<IMAGE_TYPE, COMPOSITE_TRANSFORM_TYPE>(groups[i].images, resampling_transform, settings);
+                }
+                if (!warped_groups.push(i)) {
+                    return;
+                }
+            }
+            warped_groups.close();
+        } catch (...) {
+            fail();
+        }
+    };
+
+    auto write_groups = [&]() {
+        try {
+            size_t i;
+            while (warped_groups.pop(i)) {
+                for (size_t j = 0; j < groups[i].targets.size(); j++) {
+                    write_image<IMAGE_TYPE>(groups[i].images[j], targets[groups[i].targets[j]][1].c_str());
+                }
+                groups[i].images.clear();
+                memory_in_flight.release(groups[i].bytes);
+                targets_in_flight.release(groups[i].targets.size());
+            }
+        } catch (...) {
+            fail();
+        }
+    };
+
+    thread reader(read_groups);
+    thread resampler(warp_groups);
+    thread writer(write_groups);
+    reader.join();
+    resampler.join();
+    writer.join();
+
+    if (error) {
+        rethrow_exception(error);
+    }
+}
+
+
+template<typename TYPES>
+typename TYPES::COMPOSITE_TRANSFORM_TYPE::Pointer get_resampling_transform(const RegistrationResult<TYPES>& result) {
+    // Returns the transforms of result fused into one linear and one B-spline transform, for resampling images
+    // It maps points like compose_transforms(result), but the flip and the rigid transform are one matrix
+    typedef typename TYPES::FLIP_TRANSFORM_TYPE LINEAR_TRANSFORM_TYPE;
+    typename LINEAR_TRANSFORM_TYPE::Pointer linear_transform = LINEAR_TRANSFORM_TYPE::New();
+    linear_transform->SetCenter(result.rigid_transform->GetCenter());
+    linear_transform->SetMatrix(result.rigid_transform->GetMatrix());
+    linear_transform->SetTranslation(result.rigid_transform->GetTranslation());
+    if (result.flip_transform) {
+        // The flip is applied to the output of the rigid transform
+        linear_transform->Compose(result.flip_transform.GetPointer(), false);
+    }
+
+    typename TYPES::COMPOSITE_TRANSFORM_TYPE::Pointer composite_transform = TYPES::COMPOSITE_TRANSFORM_TYPE::New();
+    composite_transform->AddTransform(linear_transform);
+    composite_transform->AddTransform(result.bspline_transform);
+    return composite_transform;
+}
+
+
+template<typename TYPES>
+void write_registration_transform(const RegistrationResult<TYPES>& result, const RegistrationSettings& settings, const char* transform_path) {
+    // Writes the composed transforms of result, along with the settings that produced them
+    // Text transform files keep the settings as comments, which transform readers skip.
+    //  Other formats get them in a file next to the transform, <transform_path>.settings
+    write_transform<typename TYPES::COMPOSITE_TRANSFORM_TYPE>(compose_transforms<TYPES>(result), transform_path);
+
+    const string extension = itksys::SystemTools::LowerCase(itksys::SystemTools::GetFilenameLastExtension(transform_path));
+    if (extension == ".txt" || extension == ".tfm") {
+        ofstream transform_file(transform_path, ios::out | ios::app);
+        write_registration_settings(settings, transform_file, "# ");
+    } else {
+        ofstream settings_file((string(transform_path) + ".settings").c_str());
+        write_registration_settings(settings, settings_file, "");
+    }
+}
+
+
+void write_schedule_setting(ostream& stream, const char* prefix, const char* name, const vector<double>& values) {
+    stream << prefix << name << " = ";
+    for (size_t i = 0; i < values.size(); i++) {
+        stream << (i ? "," : "") << values[i];
+    }
+    stream << endl;
+}
+
+
+void write_registration_settings(const RegistrationSettings& settings, ostream& stream, const char* prefix) {
+    // Writes one "name = value" line per setting, each preceded by prefix
+    const PyramidSchedule* schedules[] = {&settings.rigid_schedule, &settings.bspline_schedule};
+    const char* stages[] = {"rigid", "bspline"};
+    for (int i = 0; i < 2; i++) {
+        const PyramidSchedule& schedule = *schedules[i];
+        string stage = stages[i];
+        write_schedule_setting(stream, prefix, (stage + "_shrink_factors").c_str(),
+                               vector<double>(schedule.shrink_factors.begin(), schedule.shrink_factors.end()));
+        write_schedule_setting(stream, prefix, (stage + "_smoothing_sigmas").c_str(), schedule.smoothing_sigmas);
+        write_schedule_setting(stream, prefix, (stage + "_iterations").c_str(),
+                               vector<double>(schedule.iterations.begin(), schedule.iterations.end()));
+        write_schedule_setting(stream, prefix, (stage + "_sampling_percentages").c_str(), schedule.sampling_percentages);
+        if (!schedule.mesh_sizes.empty()) {
+            write_schedule_setting(stream, prefix, (stage + "_mesh_sizes").c_str(),
+                                   vector<double>(schedule.mesh_sizes.begin(), schedule.mesh_sizes.end()));
+        }
+    }
+    stream << prefix << "sampling_strategy = " << get_sampling_strategy_name(settings.rigid_schedule.sampling.strategy) << endl;
+    stream << prefix << "sampling_seed = " << settings.rigid_schedule.sampling.seed << endl;
+    stream << prefix << "plateau_window = " << settings.rigid_schedule.early_stopping.window << endl;
+    stream << prefix << "plateau_threshold = " << settings.rigid_schedule.early_stopping.threshold << endl;
+    write_schedule_setting(stream, prefix, "rigid_start_angles", settings.rigid_start_angles);
+    stream << prefix << "rigid_flips = " << (settings.rigid_try_flips ? "on" : "off") << endl;
+    stream << prefix << "rigid_starts_to_refine = " << settings.rigid_starts_to_refine << endl;
+    stream << prefix << "interpolation = " << get_interpolation_method_name(settings.interpolation) << endl;
+}
@@ -2,8 +2,19 @@
 #define IMAGE_TO_IMAGE_REGISTRATION
 
 #include <iostream>
+#include <algorithm>
+#include <fstream>
 #include <vector>
 #include <string>
+#include <sstream>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <exception>
+#include <stdexcept>
+#include <limits>
+#include <cmath>
+#include <cstdlib>
 #include "optionparser.h"
 
 #include "itkImage.h"
@@ -14,38 +25,188 @@
 #include "itkMattesMutualInformationImageToImageMetricv4.h"
 #include "itkLBFGSBOptimizerv4.h"
 #include "itkResampleImageFilter.h"
+#include "itkSmoothingRecursiveGaussianImageFilter.h"
+#include "itkShrinkImageFilter.h"
 
 #include "itkNearestNeighborInterpolateImageFunction.h"
 #include "itkLinearInterpolateImageFunction.h"
 
 #include "itkBSplineTransform.h"
 #include "itkCenteredRigid2DTransform.h"
+#include "itkEuler3DTransform.h"
 #include "itkCompositeTransform.h"
+#include "itkAffineTransform.h"
 
 #include "itkBSplineTransformInitializer.h"
+#include "itkBSplineTransformParametersAdaptor.h"
 #include "itkCenteredTransformInitializer.h"
 
 #include "itkTimeProbesCollectorBase.h"
 #include "itkMemoryProbesCollectorBase.h"
 #include "itkCommand.h"
+#include "itksys/SystemTools.hxx"
 
 #include "apply_transform.h"
+#include "bounded_queue.h"
 #include "image_io.h"
 #include "string_splitting.h"
+#include "thread_budget.h"
 
-// For the time being, this works on 2d images
-const int IMAGE_DIMENSIONS = 2;
 const int BSPLINE_ORDER = 3;
 
-typedef itk::Image<float, IMAGE_DIMENSIONS> IMAGE_TYPE;
-typedef itk::BSplineTransform<double, IMAGE_DIMENSIONS, BSPLINE_ORDER> BSPLINE_TRANSFORM_TYPE;
-typedef itk::CenteredRigid2DTransform<double> RIGID_TRANSFORM_TYPE;
-typedef itk::CompositeTransform<double, IMAGE_DIMENSIONS> COMPOSITE_TRANSFORM_TYPE;
+// The image and transform types of a registration of images with DIMENSIONS dimensions
+template<unsigned int DIMENSIONS, typename RIGID_TRANSFORM>
+struct RegistrationTypesBase {
+    static const unsigned int Dimensions = DIMENSIONS;
 
-void configure_optimizer(itk::LBFGSBOptimizerv4::Pointer optimizer, unsigned int num_params);
-IMAGE_TYPE::Pointer load_image(const char* image_path);
-RIGID_TRANSFORM_TYPE::Pointer compute_rigid_transform(IMAGE_TYPE::Pointer fixed_image, IMAGE_TYPE::Pointer moving_image);
-BSPLINE_TRANSFORM_TYPE::Pointer compute_bSpline_transform(IMAGE_TYPE::Pointer fixed_image, IMAGE_TYPE::Pointer moving_image);
-COMPOSITE_TRANSFORM_TYPE::Pointer compose_transforms(RIGID_TRANSFORM_TYPE::Pointer rigid_transform, BSPLINE_TRANSFORM_TYPE::Pointer bspline_transform);
+    typedef itk::Image<float, DIMENSIONS> IMAGE_TYPE;
+    typedef itk::BSplineTransform<double, DIMENSIONS, BSPLINE_ORDER> BSPLINE_TRANSFORM_TYPE;
+    typedef RIGID_TRANSFORM RIGID_TRANSFORM_TYPE;
+    typedef itk::CompositeTransform<double, DIMENSIONS> COMPOSITE_TRANSFORM_TYPE;
+    typedef itk::AffineTransform<double, DIMENSIONS> FLIP_TRANSFORM_TYPE;
+
+    // One image per pyramid level, from coarsest to finest
+    typedef std::vector<typename IMAGE_TYPE::Pointer> IMAGE_PYRAMID_TYPE;
+};
+
+template<unsigned int DIMENSIONS>
+struct RegistrationTypes;
+
+// Sections are registered with a rigid transform that also optimizes its center
+template<>
+struct RegistrationTypes<2> : public RegistrationTypesBase<2, itk::CenteredRigid2DTransform<double> > {};
+
+// Volumes are registered with an euler transform, about the center found by the initializer
+template<>
+struct RegistrationTypes<3> : public RegistrationTypesBase<3, itk::Euler3DTransform<double> > {};
+
+// How the metric picks the fixed image points it is evaluated on
+// NONE uses every pixel, REGULAR every n-th pixel, and RANDOM a random subset drawn with seed
+enum SamplingStrategy {
+    SAMPLE_NONE,
+    SAMPLE_REGULAR,
+    SAMPLE_RANDOM
+};
+
+struct MetricSampling {
+    SamplingStrategy strategy;
+    int seed;
+};
+
+// A level stops early once the metric changed by less than threshold, relative to its value, over the last window
+//  iterations. A threshold of 0 runs every level for its whole iteration budget
+struct EarlyStopping {
+    unsigned int window;
+    double threshold;
+};
+
+// Shrink factors, smoothing sigmas (in physical units), optimizer iteration budgets and metric sampling percentages
+//  of each pyramid level, from coarsest to finest
+struct PyramidSchedule {
+    std::vector<unsigned int> shrink_factors;
+    std::vector<double> smoothing_sigmas;
+    std::vector<unsigned int> iterations;
+    std::vector<double> sampling_percentages;
+    MetricSampling sampling;
+    EarlyStopping early_stopping;
+
+    // B-spline control point mesh size of each level, empty for stages without a B-spline transform
+    std::vector<unsigned int> mesh_sizes;
+
+    // Threads given to the filters, metric and optimizer of the stage, 0 leaves them at ITK's global default
+    unsigned int number_of_threads;
+};
+
+// Options controlling the registration stages
+struct RegistrationSettings {
+    PyramidSchedule rigid_schedule;
+    PyramidSchedule bspline_schedule;
+
+    // The rigid stage starts from each of these angles (degrees), optionally also with the moving image flipped,
+    //  compares the starts on the coarsest rigid level, and refines the best few through the remaining levels
+    std::vector<double> rigid_start_angles;
+    bool rigid_try_flips;
+    unsigned int rigid_starts_to_refine;
+
+    // Threads for preparing the fixed image pyramids, and for resampling outputs, 0 for ITK's global default
+    unsigned int io_threads;
+    unsigned int resample_threads;
+
+    // The --apply targets being read, resampled or written at once, and the memory they may hold, 0 for no limit
+    unsigned int apply_targets_in_flight;
+    size_t apply_memory_limit;
+
+    // How the output and --apply images are interpolated
+    InterpolationMethod interpolation;
+};
+
+// The transforms computed for one moving image, and the moving image resampled onto the fixed image
+// flip_transform is null unless the moving image had to be mirrored before the rigid transform could be found
+template<typename TYPES>
+struct RegistrationResult {
+    typename TYPES::FLIP_TRANSFORM_TYPE::Pointer flip_transform;
+    typename TYPES::RIGID_TRANSFORM_TYPE::Pointer rigid_transform;
+    typename TYPES::BSPLINE_TRANSFORM_TYPE::Pointer bspline_transform;
+    typename TYPES::IMAGE_TYPE::Pointer output_image;
+};
+
+// One moving image of a batch, and where to save its results
+struct RegistrationJob {
+    std::string moving_path;
+    std::string output_path;
+    std::string transform_path;
+};
+
+void configure_optimizer(itk::LBFGSBOptimizerv4::Pointer optimizer, unsigned int num_params, unsigned int iterations=200);
+PyramidSchedule get_rigid_pyramid_schedule(unsigned int dimensions);
+PyramidSchedule get_bspline_pyramid_schedule(unsigned int dimensions);
+PyramidSchedule parse_pyramid_schedule(const char* shrink_factors, const char* smoothing_sigmas, const char* iterations, const char* sampling_percentages, const PyramidSchedule& defaults);
+SamplingStrategy parse_sampling_strategy(const std::string& strategy);
+std::vector<unsigned int> parse_mesh_schedule(const std::string& mesh_schedule, unsigned int number_of_levels);
+const char* get_sampling_strategy_name(SamplingStrategy strategy);
+RegistrationSettings get_default_registration_settings(unsigned int dimensions);
+RegistrationSettings get_registration_settings(option::Option* options, unsigned int dimensions);
+std::vector<RegistrationJob> read_batch_file(const char* batch_path);
+void write_registration_settings(const RegistrationSettings& settings, std::ostream& stream, const char* prefix);
+
+// The registration pipeline, for either RegistrationTypes<2> or RegistrationTypes<3>
+template<typename TYPES>
+int register_images(option::Option* options, const RegistrationSettings& settings);
+template<typename TYPES>
+typename TYPES::IMAGE_PYRAMID_TYPE build_image_pyramid(typename TYPES::IMAGE_TYPE::Pointer image, const PyramidSchedule& schedule, bool shrink, unsigned int number_of_threads=0);
+template<typename TYPES>
+typename TYPES::IMAGE_PYRAMID_TYPE graft_image_pyramid(const typename TYPES::IMAGE_PYRAMID_TYPE& pyramid);
+template<typename TYPES>
+typename TYPES::RIGID_TRANSFORM_TYPE::Pointer initialize_rigid_transform(typename TYPES::IMAGE_TYPE::Pointer fixed_image, typename TYPES::IMAGE_TYPE::Pointer moving_image);
+template<typename TYPES>
+double optimize_rigid_transform(typename TYPES::IMAGE_TYPE::Pointer fixed_image, typename TYPES::IMAGE_TYPE::Pointer moving_image, typename TYPES::RIGID_TRANSFORM_TYPE::Pointer transform, const PyramidSchedule& schedule, unsigned int level, bool report_progress);
+template<typename TYPES>
+double optimize_rigid_transform(const typename TYPES::IMAGE_PYRAMID_TYPE& fixed_pyramid, const typename TYPES::IMAGE_PYRAMID_TYPE& moving_pyramid, typename TYPES::RIGID_TRANSFORM_TYPE::Pointer transform, const PyramidSchedule& schedule, unsigned int first_level, bool report_progress);
+template<typename TYPES>
+typename TYPES::RIGID_TRANSFORM_TYPE::Pointer compute_rigid_transform(typename TYPES::IMAGE_TYPE::Pointer fixed_image, typename TYPES::IMAGE_TYPE::Pointer moving_image);
+template<typename TYPES>
+typename TYPES::RIGID_TRANSFORM_TYPE::Pointer compute_multistart_rigid_transform(typename TYPES::IMAGE_TYPE::Pointer fixed_image, const typename TYPES::IMAGE_PYRAMID_TYPE& fixed_pyramid, typename TYPES::IMAGE_TYPE::Pointer moving_image, const RegistrationSettings& settings, typename TYPES::FLIP_TRANSFORM_TYPE::Pointer& flip_transform);
+template<typename TYPES>
+typename TYPES::FLIP_TRANSFORM_TYPE::Pointer create_flip_transform(typename TYPES::IMAGE_TYPE::Pointer image);
+template<typename TYPES>
+typename TYPES::BSPLINE_TRANSFORM_TYPE::Pointer compute_bSpline_transform(typename TYPES::IMAGE_TYPE::Pointer fixed_image, typename TYPES::IMAGE_TYPE::Pointer moving_image);
+template<typename TYPES>
+typename TYPES::BSPLINE_TRANSFORM_TYPE::Pointer compute_bSpline_transform(const typename TYPES::IMAGE_PYRAMID_TYPE& fixed_pyramid, typename TYPES::IMAGE_TYPE::Pointer moving_image, const PyramidSchedule& schedule, typename TYPES::COMPOSITE_TRANSFORM_TYPE::Pointer moving_initial_transform=NULL);
+template<typename TYPES>
+RegistrationResult<TYPES> register_moving_image(typename TYPES::IMAGE_TYPE::Pointer fixed_image, const typename TYPES::IMAGE_PYRAMID_TYPE& fixed_rigid_pyramid, const typename TYPES::IMAGE_PYRAMID_TYPE& fixed_bspline_pyramid, const RegistrationSettings& settings, typename TYPES::IMAGE_TYPE::Pointer moving_image);
+template<typename TYPES>
+void register_batch(typename TYPES::IMAGE_TYPE::Pointer fixed_image, const std::vector<RegistrationJob>& jobs, const RegistrationSettings& settings, unsigned int number_of_concurrent_jobs);
+template<typename TYPES>
+typename TYPES::COMPOSITE_TRANSFORM_TYPE::Pointer compose_transforms(typename TYPES::RIGID_TRANSFORM_TYPE::Pointer rigid_transform, typename TYPES::BSPLINE_TRANSFORM_TYPE::Pointer bspline_transform);
+template<typename TYPES>
+typename TYPES::COMPOSITE_TRANSFORM_TYPE::Pointer compose_transforms(const RegistrationResult<TYPES>& result);
+template<typename TYPES>
+typename TYPES::COMPOSITE_TRANSFORM_TYPE::Pointer get_rigid_stage_transform(const RegistrationResult<TYPES>& result);
+template<typename TYPES>
+void apply_to_targets(const std::vector<std::vector<std::string> >& targets, typename TYPES::COMPOSITE_TRANSFORM_TYPE::Pointer resampling_transform, typename DisplacementFieldTypes<typename TYPES::IMAGE_TYPE>::FIELD_TYPE::Pointer displacement_field, const RegistrationSettings& settings);
+template<typename TYPES>
+typename TYPES::COMPOSITE_TRANSFORM_TYPE::Pointer get_resampling_transform(const RegistrationResult<TYPES>& result);
+template<typename TYPES>
+void write_registration_transform(const RegistrationResult<TYPES>& result, const RegistrationSettings& settings, const char* transform_path);
 
 #endif
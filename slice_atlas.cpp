@@ -1,4 +1,5 @@
 #include "slice_atlas.h"
+#include "slice_server.h"
 
 using namespace std;
 
@@ -46,7 +47,15 @@ enum optionIndex {
     ATLAS_PATH,
     OUTPUT_PATH,
     SLICE_INDEX,
-    SLICE_AXIS
+    SLICE_AXIS,
+    MAP_ATLAS,
+    PLANE_TILT,
+    PLANE_NORMAL,
+    INTERPOLATION,
+    SERVE,
+    ALL_SLICES,
+    THREADS,
+    PYRAMID_LEVEL
 };
 
 
@@ -55,12 +64,225 @@ const option::Descriptor usage[] = {
                                        "Options: "},
     {HELP, 0, "h", "help", Arg::None, "--help, -h \tDisplay this help message and exit"},
     {ATLAS_PATH, 0, "a", "atlas", Arg::Required, "--atlas, -a path \tPath to the atlas to slice from"},
-    {OUTPUT_PATH, 0, "o", "output", Arg::Required, "--output, -o path \tPath to save the output moving image"},
-    {SLICE_INDEX, 0, "i", "index", Arg::Required, "--index, -i index \tIndex of the desired slice on the slice axis"},
+    {OUTPUT_PATH, 0, "o", "output", Arg::Required, "--output, -o path \tPath to save the output slice\n"
+                                                   "When several slices are requested, path may be a pattern containing one integer "
+                                                   "conversion that is replaced with the slice index, e.g. slice_%04d.tif\n"
+                                                   "Otherwise the slices are written as a single stack spaced like them, e.g. slices.tif,\n"
+                                                   "which needs evenly spaced slices in increasing order"},
+    {SLICE_INDEX, 0, "i", "index", Arg::Required, "--index, -i indices \tIndices of the desired slices on the slice axis\n"
+                                                  "Accepts a comma separated list of indices and start:stop[:step] ranges, e.g. 10,100:400:2"},
     {SLICE_AXIS, 0, "a", "axis", Arg::Required, "--axis, -a int \tIndex of the axis to slice along"},
+    {MAP_ATLAS, 0, "m", "map", Arg::None, "--map, -m \tMemory map the atlas instead of reading it\n"
+                                          "Only uncompressed MetaImage (.mha/.mhd) atlases can be mapped, other atlases are read normally"},
+    {PLANE_TILT, 0, "t", "tilt", Arg::Required, "--tilt, -t pitch,yaw \tTilt the slice plane by pitch and yaw degrees about the center of the slice\n"
+                                                "Pitch rotates around the first remaining axis, and yaw around the second"},
+    {PLANE_NORMAL, 0, "n", "normal", Arg::Required, "--normal, -n x,y,z \tSlice along the plane with this normal, in atlas axis order, "
+                                                    "through the center of the slice"},
+    {INTERPOLATION, 0, "p", "interpolation", Arg::Required, "--interpolation, -p type \tInterpolation used for tilted slices, linear or nearest\n"
+                                                            "Default: linear. Use nearest for label atlases"},
+    {SERVE, 0, "s", "serve", Arg::Required, "--serve, -s socket_path \tKeep atlases loaded and answer slice requests on a unix domain socket\n"
+                                            "See slice_server.h for the request format. Combine with --map to share mapped atlases"},
+    {ALL_SLICES, 0, "", "all", Arg::None, "--all \tExtract every slice along the slice axis, instead of --index"},
+    {THREADS, 0, "j", "threads", Arg::Required, "--threads, -j int|auto \tNumber of threads extracting slices\n"
+                                                "Default: auto, every cpu allowed by the cgroup cpu quota and cpu affinity"},
+    {PYRAMID_LEVEL, 0, "l", "level", Arg::Numeric, "--level, -l int \tSlice from this level of the atlas pyramid, built with build_atlas_pyramid\n"
+                                                   "Indices are given at full resolution. Default: 0, the full resolution atlas"},
     {0,0,0,0,0,0}
 };
 
+template<typename PixelType>
+int slice_atlas(option::Option* options) {
+    // Writes the requested slices of the atlas, keeping the pixel type of the atlas
+    typedef itk::Image<PixelType, 2> SliceImageType;
+    typedef itk::Image<PixelType, 3> AtlasImageType;
+
+    const char* output_path = options[OUTPUT_PATH].arg;
+    const int axis_to_collapse = options[SLICE_AXIS]? atoi(options[SLICE_AXIS].arg) : 0; // Default to coronal slices
+
+    if (axis_to_collapse < 0 || axis_to_collapse > 2) {
+        cerr << "The slice axis must be 0, 1 or 2" << endl;
+        return 1;
+    }
+
+    // Oblique planes are given either as tilt angles or as a normal
+    if (options[PLANE_TILT] && options[PLANE_NORMAL]) {
+        cerr << "Specify either a tilt or a normal for the slice plane, not both" << endl;
+        return 1;
+    }
+
+    const bool is_oblique = options[PLANE_TILT] || options[PLANE_NORMAL];
+    PLANE_ROTATION_TYPE plane_rotation;
+    bool use_nearest_neighbor = false;
+    try {
+        if (options[PLANE_TILT]) {
+            plane_rotation = parse_plane_tilt(options[PLANE_TILT].arg, axis_to_collapse);
+        } else if (options[PLANE_NORMAL]) {
+            plane_rotation = parse_plane_normal(options[PLANE_NORMAL].arg, axis_to_collapse);
+        }
+        if (options[INTERPOLATION]) {
+            use_nearest_neighbor = parse_use_nearest_neighbor(options[INTERPOLATION].arg);
+        }
+    } catch (invalid_argument & err) {
+        cerr << err.what() << endl;
+        return 1;
+    }
+
+
+    // Slices of a pyramid level are read from its own file
+    const unsigned int pyramid_level = options[PYRAMID_LEVEL] ? atoi(options[PYRAMID_LEVEL].arg) : 0;
+    string level_path = options[ATLAS_PATH].arg;
+    if (pyramid_level > 0) {
+        if (!atlas_pyramid_is_current(options[ATLAS_PATH].arg, pyramid_level)) {
+            cerr << "The atlas pyramid of " << options[ATLAS_PATH].arg << " is missing, out of date, or has no level "
+                 << pyramid_level << ". Build it with build_atlas_pyramid" << endl;
+            return 1;
+        }
+        level_path = get_pyramid_level_path(options[ATLAS_PATH].arg, pyramid_level);
+    }
+    const char* atlas_path = level_path.c_str();
+
+    // Bricked atlases are read brick by brick as slices need them, and can only be sliced along an axis
+    const bool is_bricked = is_bricked_atlas(atlas_path);
+    if (is_bricked && (is_oblique || options[MAP_ATLAS] || pyramid_level > 0)) {
+        cerr << "Bricked atlases can only be sliced along an axis, without --map or --level" << endl;
+        return 1;
+    }
+
+    // Check the requested slices against the atlas header before reading any voxels
+    typename BrickedAtlas<PixelType>::Pointer bricked_atlas;
+    typename AtlasImageType::RegionType atlas_region;
+    if (is_bricked) {
+        try {
+            bricked_atlas = open_bricked_atlas<PixelType>(atlas_path);
+        } catch (runtime_error & err) {
+            cerr << err.what() << endl;
+            return 1;
+        }
+        atlas_region = bricked_atlas->GetLargestPossibleRegion();
+    } else {
+        atlas_region = read_image_region<AtlasImageType>(atlas_path);
+    }
+    const int number_of_slices = atlas_region.GetSize()[axis_to_collapse];
+
+    // Parse slice indices
+    // Files are named by the full resolution index the user asked for, even when slicing a pyramid level
+    vector<int> slice_indices;
+    vector<int> slice_names;
+    if (options[ALL_SLICES]) {
+        for (int index = 0; index < number_of_slices; index++) {
+            slice_indices.push_back(index);
+        }
+
+        // Every slice of a pyramid level is named by the full resolution slice it lies on
+        if (pyramid_level > 0) {
+            typename AtlasImageType::Pointer atlas_header = read_image_header<AtlasImageType>(options[ATLAS_PATH].arg);
+            typename AtlasImageType::Pointer level_header = read_image_header<AtlasImageType>(atlas_path);
+            for (int index = 0; index < number_of_slices; index++) {
+                slice_names.push_back(get_pyramid_slice_index<AtlasImageType>(level_header, atlas_header, index, axis_to_collapse));
+            }
+        }
+    } else {
+        try {
+            slice_indices = parse_slice_indices(options[SLICE_INDEX].arg);
+        } catch (invalid_argument & err) {
+            cerr << err.what() << endl;
+            return 1;
+        }
+
+        if (slice_indices.empty()) {
+            cerr << "No slice indices were specified by '" << options[SLICE_INDEX].arg << "'" << endl;
+            return 1;
+        }
+
+        // Move full resolution indices onto the pyramid level
+        // Neighboring indices can fall on the same level slice, which is then extracted once,
+        //  and named by the first index that asked for it
+        slice_names = slice_indices;
+        if (pyramid_level > 0) {
+            typename AtlasImageType::Pointer atlas_header = read_image_header<AtlasImageType>(options[ATLAS_PATH].arg);
+            typename AtlasImageType::Pointer level_header = read_image_header<AtlasImageType>(atlas_path);
+            vector<int> level_indices;
+            vector<int> level_names;
+            for (size_t i = 0; i < slice_indices.size(); i++) {
+                const int level_index = get_pyramid_slice_index<AtlasImageType>(
+                    atlas_header, level_header, slice_indices[i], axis_to_collapse);
+                if (find(level_indices.begin(), level_indices.end(), level_index) == level_indices.end()) {
+                    level_indices.push_back(level_index);
+                    level_names.push_back(slice_indices[i]);
+                }
+            }
+
+            if (level_indices.size() < slice_indices.size()) {
+                cout << slice_indices.size() - level_indices.size() << " of the requested slices fall on the same slice of level "
+                     << pyramid_level << " as another, and are written once" << endl;
+            }
+            slice_indices = level_indices;
+            slice_names = level_names;
+        }
+    }
+    if (slice_names.empty()) {
+        slice_names = slice_indices;
+    }
+
+    int first_slice_index = slice_indices[0];
+    int last_slice_index = slice_indices[0];
+    for (size_t i = 0; i < slice_indices.size(); i++) {
+        if (slice_indices[i] < 0 || slice_indices[i] >= number_of_slices) {
+            cerr << "Slice index " << slice_indices[i] << " is outside of the atlas, which has "
+                 << number_of_slices << " slices on axis " << axis_to_collapse << endl;
+            return 1;
+        }
+        first_slice_index = min(first_slice_index, slice_indices[i]);
+        last_slice_index = max(last_slice_index, slice_indices[i]);
+    }
+
+    // A stack has a single spacing between its slices, so it cannot hold slices in any other order
+    if (slice_indices.size() > 1 && !is_slice_path_pattern(output_path) && get_stack_step(slice_indices) == 0) {
+        cerr << "Only evenly spaced slices in increasing order can be written as one stack, "
+             << "write the slices to a filename pattern such as slice_%04d.tif instead" << endl;
+        return 1;
+    }
+
+    SliceGeometry geometry;
+    geometry.axis_to_collapse = axis_to_collapse;
+    geometry.is_oblique = is_oblique;
+    geometry.plane_rotation = plane_rotation;
+    geometry.use_nearest_neighbor = use_nearest_neighbor;
+
+    unsigned int number_of_threads = 0;
+    try {
+        number_of_threads = parse_thread_count(options[THREADS] ? options[THREADS].arg : "auto");
+    } catch (invalid_argument & err) {
+        cerr << err.what() << endl;
+        return 1;
+    }
+
+    if (is_bricked) {
+        write_atlas_slices<SliceImageType>(bricked_atlas, slice_indices, slice_names, geometry, output_path, number_of_threads);
+        return 0;
+    }
+
+    // Load the slab of the atlas spanning the requested slices once, and extract every slice from it
+    // A mapped atlas is shared through the page cache, so only the pages holding the slices are ever read
+    // Tilted planes leave the slab, so they need the entire atlas
+    typename AtlasImageType::Pointer atlas;
+    if (options[MAP_ATLAS]) {
+        atlas = map_image<AtlasImageType>(atlas_path);
+    } else if (is_oblique) {
+        atlas = load_image<AtlasImageType>(atlas_path);
+    } else {
+        typename AtlasImageType::RegionType slab_region = get_slab_region<AtlasImageType>(
+            atlas_region, first_slice_index, last_slice_index, axis_to_collapse);
+        atlas = load_image_region<AtlasImageType>(atlas_path, slab_region);
+    }
+    // Slices are extracted on several threads, each from its own view of the atlas, so none may update the reader
+    atlas->DisconnectPipeline();
+
+    write_atlas_slices<SliceImageType>(atlas, slice_indices, slice_names, geometry, output_path, number_of_threads);
+    return 0;
+}
+
+
 int main(int argc, char** argv ) {
     // Parse input
     argv += (argc>0);
@@ -76,24 +298,42 @@ int main(int argc, char** argv ) {
         return 1;
     }
 
+    typedef itk::Image<float, 2> SliceImageType;
+
+    // In server mode, the atlas and slices are given with each request
+    if (options[SERVE]) {
+        return serve_atlas_slices<SliceImageType>(options[SERVE].arg, options[MAP_ATLAS]);
+    }
+
     // Check for required arguments
-    if (!options[ATLAS_PATH] || !options[OUTPUT_PATH] || !options[SLICE_INDEX]) {
+    if (!options[ATLAS_PATH] || !options[OUTPUT_PATH] || !(options[SLICE_INDEX] || options[ALL_SLICES])) {
         cout << "Insufficient arguments!!" << endl;
-        cout << "An atlas path, output path, and slice index must be specified" << endl << endl;
+        cout << "An atlas path, output path, and slice index (or --all) must be specified" << endl << endl;
         option::printUsage(cout, usage);
         return 1;
     }
 
-    // Extract slice
-    const int slice_index = atoi(options[SLICE_INDEX].arg);
-    const char* atlas_path = options[ATLAS_PATH].arg; 
-    const char* output_path = options[OUTPUT_PATH].arg;
-    const int axis_to_collapse = options[SLICE_AXIS]? atoi(options[SLICE_AXIS].arg) : 0; // Default to coronal slices
-
-
-    typedef itk::Image<float, 2> SliceImageType;
-    SliceImageType::Pointer atlas_slice = get_atlas_slice<SliceImageType>(atlas_path, slice_index, axis_to_collapse);
+    // Slice the atlas with its own pixel type, so that label values are kept exactly
+    // Pyramid levels are always stored as float
+    const bool use_pyramid = options[PYRAMID_LEVEL] && atoi(options[PYRAMID_LEVEL].arg) > 0;
+    itk::ImageIOBase::IOComponentType component_type = itk::ImageIOBase::FLOAT;
+    if (!use_pyramid) {
+        try {
+            component_type = read_atlas_component_type(options[ATLAS_PATH].arg);
+        } catch (runtime_error & err) {
+            cerr << err.what() << endl;
+            return 1;
+        }
+    }
 
-    write_image<SliceImageType>(atlas_slice, output_path);
-    return 0;
+    switch (component_type) {
+        case itk::ImageIOBase::UCHAR:
+            return slice_atlas<unsigned char>(options);
+        case itk::ImageIOBase::USHORT:
+            return slice_atlas<unsigned short>(options);
+        case itk::ImageIOBase::UINT:
+            return slice_atlas<unsigned int>(options);
+        default:
+            return slice_atlas<float>(options);
+    }
 }
@@ -1,7 +1,22 @@
 #include "image_slicing.h"
 #include "image_io.h"
+#include "image_mapping.h"
+#include "atlas_pyramid.h"
 #include "optionparser.h"
+#include "string_splitting.h"
+#include "bounded_queue.h"
+#include "thread_budget.h"
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
 
 #include "itkImage.h"
 
@@ -9,16 +24,402 @@
 #define SLICE_ATLAS
 
 template<typename IMAGE_TYPE>
-typename IMAGE_TYPE::Pointer get_atlas_slice(const char* atlas_path, const int slice_index, const int axis_to_collapse=0) {;
+typename IMAGE_TYPE::Pointer get_atlas_slice(const char* atlas_path, const int slice_index, const int axis_to_collapse=0, const unsigned int pyramid_level=0) {;
     // Returns an image of IMAGE_TYPE containing a slice from the atlas at atlas_path
     // Creates coronal slices by default
+    // A pyramid_level above 0 returns the nearest slice of that level of the atlas pyramid, see atlas_pyramid.h
+    //  slice_index is always given at the full resolution of the atlas
     typedef itk::Image<typename IMAGE_TYPE::PixelType, 3> AtlasImageType;
+
+    std::string level_path = atlas_path;
+    int level_slice_index = slice_index;
+    if (pyramid_level > 0) {
+        if (!atlas_pyramid_is_current(atlas_path, pyramid_level)) {
+            throw std::runtime_error("The atlas pyramid of " + level_path + " is missing or out of date, run build_atlas_pyramid");
+        }
+        level_path = get_pyramid_level_path(atlas_path, pyramid_level);
+        level_slice_index = get_pyramid_slice_index<AtlasImageType>(
+            read_image_header<AtlasImageType>(atlas_path), read_image_header<AtlasImageType>(level_path.c_str()),
+            slice_index, axis_to_collapse);
+    }
     
-    // Load the atlas
-    typename AtlasImageType::Pointer atlas = load_image<AtlasImageType>(atlas_path);
+    // Load only the slab of the atlas containing the slice
+    typename AtlasImageType::RegionType slab_region = get_slab_region<AtlasImageType>(
+        read_image_region<AtlasImageType>(level_path.c_str()), level_slice_index, level_slice_index, axis_to_collapse);
+    typename AtlasImageType::Pointer atlas = load_image_region<AtlasImageType>(level_path.c_str(), slab_region);
 
     // Return a slice of the atlas
-    return extract_image_slice<IMAGE_TYPE>(atlas, slice_index, axis_to_collapse);
+    return extract_image_slice<IMAGE_TYPE>(atlas, level_slice_index, axis_to_collapse);
+}
+
+inline itk::ImageIOBase::IOComponentType read_atlas_component_type(const char* atlas_path) {
+    // Returns the type the pixels of the atlas at atlas_path are stored as, for bricked atlases as well
+    if (is_bricked_atlas(atlas_path)) {
+        return read_bricked_component_type(atlas_path);
+    }
+    return read_component_type(atlas_path);
+}
+
+inline int parse_slice_index(const std::string& index, const std::string& item) {
+    // Parses one slice index or range bound of item, throwing std::invalid_argument unless it is a whole number
+    char* end = NULL;
+    const long value = strtol(index.c_str(), &end, 10);
+    if (index.empty() || *end != 0 || value < INT_MIN || value > INT_MAX) {
+        throw std::invalid_argument("Invalid slice index '" + index + "' in '" + item + "'");
+    }
+    return static_cast<int>(value);
+}
+
+inline std::vector<int> parse_slice_indices(const std::string& index_spec) {
+    // Parses a comma separated list of slice indices and ranges into a list of indices
+    // Ranges are written start:stop[:step], and like python slices, stop is exclusive
+    //  e.g. "3,10:16:2" -> 3, 10, 12, 14
+    std::vector<int> slice_indices;
+    std::vector<std::string> items = split(index_spec, ',');
+
+    for (size_t i = 0; i < items.size(); i++) {
+        std::vector<std::string> bounds = split(items[i], ':');
+        if (!items[i].empty() && items[i][items[i].size() - 1] == ':') {
+            // split drops a trailing empty field, which is a missing bound, e.g. "5:"
+            bounds.push_back("");
+        }
+        if (bounds.size() < 2) {
+            slice_indices.push_back(parse_slice_index(items[i], items[i]));
+            continue;
+        }
+
+        if (bounds.size() > 3) {
+            throw std::invalid_argument("Invalid slice range: " + items[i]);
+        }
+
+        const int start = parse_slice_index(bounds[0], items[i]);
+        const int stop = parse_slice_index(bounds[1], items[i]);
+        const int step = bounds.size() == 3 ? parse_slice_index(bounds[2], items[i]) : 1;
+        if (step <= 0) {
+            throw std::invalid_argument("Slice range step must be positive: " + items[i]);
+        }
+
+        for (int index = start; index < stop; index += step) {
+            slice_indices.push_back(index);
+        }
+    }
+
+    return slice_indices;
+}
+
+inline bool is_slice_path_pattern(const char* output_pattern) {
+    // Returns true if output_pattern contains exactly one integer conversion (e.g. %d or %04d)
+    //  and no other printf conversions, so that it is safe to format with a slice index
+    int conversions = 0;
+    for (const char* c = output_pattern; *c; c++) {
+        if (*c != '%') {
+            continue;
+        }
+        if (*(c + 1) == '%') {
+            c++;
+            continue;
+        }
+        c++;
+        while (*c >= '0' && *c <= '9') {
+            c++;
+        }
+        if (*c != 'd') {
+            return false;
+        }
+        conversions++;
+    }
+    return conversions == 1;
+}
+
+inline std::string format_slice_path(const char* output_pattern, const int slice_index) {
+    // Substitutes slice_index into output_pattern, e.g. "slice_%04d.tif" -> "slice_0100.tif"
+    // output_pattern must be validated with is_slice_path_pattern first
+    const int length = snprintf(NULL, 0, output_pattern, slice_index);
+    std::vector<char> path(length + 1);
+    snprintf(&path[0], path.size(), output_pattern, slice_index);
+    return std::string(&path[0]);
+}
+
+inline PLANE_ROTATION_TYPE parse_plane_tilt(const std::string& tilt_spec, const int axis_to_collapse) {
+    // Parses a "pitch,yaw" tilt in degrees into a plane rotation
+    std::vector<std::string> angles = split(tilt_spec, ',');
+    if (angles.size() != 2) {
+        throw std::invalid_argument("The tilt must be given as pitch,yaw");
+    }
+    return get_tilt_rotation(axis_to_collapse, atof(angles[0].c_str()), atof(angles[1].c_str()));
+}
+
+inline PLANE_ROTATION_TYPE parse_plane_normal(const std::string& normal_spec, const int axis_to_collapse) {
+    // Parses an "x,y,z" plane normal into a plane rotation
+    std::vector<std::string> components = split(normal_spec, ',');
+    if (components.size() != 3) {
+        throw std::invalid_argument("The normal must be given as x,y,z");
+    }
+
+    itk::Vector<double, 3> normal;
+    for (int i = 0; i < 3; i++) {
+        normal[i] = atof(components[i].c_str());
+    }
+    if (normal.GetNorm() == 0) {
+        throw std::invalid_argument("The normal must not be zero");
+    }
+    return get_normal_rotation(axis_to_collapse, normal);
+}
+
+inline bool parse_use_nearest_neighbor(const std::string& interpolation) {
+    // Returns true for "nearest" and false for "linear" interpolation
+    if (interpolation != "linear" && interpolation != "nearest") {
+        throw std::invalid_argument("Unknown interpolation '" + interpolation + "', use linear or nearest");
+    }
+    return interpolation == "nearest";
+}
+
+// Describes how slices are cut from an atlas
+struct SliceGeometry {
+    int axis_to_collapse;
+    bool is_oblique;
+    PLANE_ROTATION_TYPE plane_rotation;
+    bool use_nearest_neighbor;
+};
+
+template<typename IMAGE_TYPE>
+typename IMAGE_TYPE::Pointer extract_atlas_slice(
+    const typename itk::Image<typename IMAGE_TYPE::PixelType, 3>::Pointer atlas,
+    const int slice_index,
+    const SliceGeometry& geometry,
+    const unsigned int number_of_threads=0
+) {
+    // Returns the axis aligned or oblique slice at slice_index, as described by geometry
+    // number_of_threads limits the resampling of oblique slices, 0 leaves it at ITK's global default
+    if (geometry.is_oblique) {
+        return extract_oblique_slice<IMAGE_TYPE>(
+            atlas, slice_index, geometry.axis_to_collapse, geometry.plane_rotation, geometry.use_nearest_neighbor, number_of_threads);
+    }
+    return extract_image_slice<IMAGE_TYPE>(atlas, slice_index, geometry.axis_to_collapse);
+}
+
+template<typename IMAGE_TYPE>
+typename IMAGE_TYPE::Pointer extract_atlas_slice(
+    const typename BrickedAtlas<typename IMAGE_TYPE::PixelType>::Pointer atlas,
+    const int slice_index,
+    const SliceGeometry& geometry,
+    const unsigned int number_of_threads=0
+) {
+    // Returns the axis aligned slice at slice_index of a bricked atlas, which is always copied on the calling thread
+    if (geometry.is_oblique) {
+        throw std::invalid_argument("Bricked atlases can only be sliced along an axis");
+    }
+    return extract_bricked_slice<IMAGE_TYPE>(atlas, slice_index, geometry.axis_to_collapse);
+}
+
+template<typename TPixel>
+typename itk::Image<TPixel, 3>::Pointer get_thread_atlas(const itk::SmartPointer<itk::Image<TPixel, 3> >& atlas) {
+    // Returns a view of atlas for one extraction thread, so that concurrent resamplers never write the same image
+    return graft_image<itk::Image<TPixel, 3> >(atlas);
+}
+
+template<typename TPixel>
+typename BrickedAtlas<TPixel>::Pointer get_thread_atlas(const itk::SmartPointer<BrickedAtlas<TPixel> >& atlas) {
+    // Bricked atlases guard their brick cache themselves, so every thread can share one
+    return atlas;
+}
+
+inline unsigned int get_extraction_threads(const unsigned int number_of_threads, const size_t number_of_slices) {
+    // Returns how many threads extract slices at once, at most one per slice
+    return static_cast<unsigned int>(std::max<size_t>(std::min<size_t>(number_of_threads, number_of_slices), 1));
+}
+
+template<typename IMAGE_TYPE, typename ATLAS_POINTER_TYPE>
+void export_slice_files(
+    const ATLAS_POINTER_TYPE atlas,
+    const std::vector<int>& slice_indices,
+    const std::vector<int>& slice_names,
+    const SliceGeometry& geometry,
+    const char* output_pattern,
+    const unsigned int number_of_threads
+) {
+    // Writes each slice in slice_indices to output_pattern formatted with the matching entry of slice_names
+    // The names differ from the indices when slicing a pyramid level, whose slices are named by their full resolution index
+    // number_of_threads threads extract slices, while another thread writes them. The two are connected by a queue
+    //  that holds at most two slices per extraction thread, which bounds memory use when writing is slower than extraction
+    // Each extraction thread slices its own view of atlas, and resamples oblique slices with its share of number_of_threads
+    typedef std::pair<int, typename IMAGE_TYPE::Pointer> IndexedSliceType;
+    const unsigned int extraction_threads = get_extraction_threads(number_of_threads, slice_indices.size());
+    const unsigned int resample_threads = std::max(number_of_threads / extraction_threads, 1u);
+    BoundedQueue<IndexedSliceType> extracted_slices(2 * extraction_threads);
+    std::atomic<size_t> next_slice(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    // Record the first failure, and stop every thread
+    auto fail = [&]() {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error) {
+            error = std::current_exception();
+        }
+        extracted_slices.close();
+    };
+
+    auto extract_slices = [&]() {
+        try {
+            const ATLAS_POINTER_TYPE thread_atlas = get_thread_atlas(atlas);
+            for (size_t i = next_slice++; i < slice_indices.size(); i = next_slice++) {
+                typename IMAGE_TYPE::Pointer atlas_slice = extract_atlas_slice<IMAGE_TYPE>(thread_atlas, slice_indices[i], geometry, resample_threads);
+                if (!extracted_slices.push(IndexedSliceType(slice_names[i], atlas_slice))) {
+                    return;
+                }
+            }
+        } catch (...) {
+            fail();
+        }
+    };
+
+    auto write_slices = [&]() {
+        try {
+            IndexedSliceType indexed_slice;
+            while (extracted_slices.pop(indexed_slice)) {
+                write_image<IMAGE_TYPE>(indexed_slice.second, format_slice_path(output_pattern, indexed_slice.first).c_str());
+            }
+        } catch (...) {
+            fail();
+        }
+    };
+
+    std::thread writer(write_slices);
+    std::vector<std::thread> extractors;
+    for (unsigned int i = 0; i < extraction_threads; i++) {
+        extractors.push_back(std::thread(extract_slices));
+    }
+    for (size_t i = 0; i < extractors.size(); i++) {
+        extractors[i].join();
+    }
+
+    // Let the writer drain the queue
+    extracted_slices.close();
+    writer.join();
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+inline int get_stack_step(const std::vector<int>& slice_indices) {
+    // Returns the distance between consecutive slice_indices, or 0 unless they increase in equal steps
+    // Only evenly spaced, increasing slices describe a volume that can be given a spacing
+    if (slice_indices.size() < 2) {
+        return 1;
+    }
+    const int step = slice_indices[1] - slice_indices[0];
+    for (size_t i = 2; i < slice_indices.size(); i++) {
+        if (slice_indices[i] - slice_indices[i - 1] != step) {
+            return 0;
+        }
+    }
+    return step > 0 ? step : 0;
+}
+
+template<typename IMAGE_TYPE, typename ATLAS_POINTER_TYPE>
+typename itk::Image<typename IMAGE_TYPE::PixelType, 3>::Pointer stack_slices(
+    const ATLAS_POINTER_TYPE atlas,
+    const std::vector<int>& slice_indices,
+    const SliceGeometry& geometry,
+    const unsigned int number_of_threads
+) {
+    // Returns a volume containing the slices in slice_indices, stacked along its last axis in the order given
+    // The slices must be evenly spaced and increasing, see get_stack_step, and the stack is spaced like them
+    // The slices are extracted by number_of_threads threads, straight into the volume, like export_slice_files
+    typedef itk::Image<typename IMAGE_TYPE::PixelType, 3> StackImageType;
+    const int step = get_stack_step(slice_indices);
+    if (step == 0) {
+        throw std::invalid_argument("Only evenly spaced slices in increasing order can be written as a stack");
+    }
+    const unsigned int extraction_threads = get_extraction_threads(number_of_threads, slice_indices.size());
+    const unsigned int resample_threads = std::max(number_of_threads / extraction_threads, 1u);
+
+    // The first slice determines the size and spacing of the stack
+    typename IMAGE_TYPE::Pointer first_slice = extract_atlas_slice<IMAGE_TYPE>(atlas, slice_indices[0], geometry, number_of_threads);
+    typename IMAGE_TYPE::SizeType slice_size = first_slice->GetLargestPossibleRegion().GetSize();
+    const size_t pixels_per_slice = first_slice->GetLargestPossibleRegion().GetNumberOfPixels();
+
+    typename StackImageType::SizeType stack_size;
+    typename StackImageType::SpacingType stack_spacing;
+    typename StackImageType::PointType stack_origin;
+    for (int i = 0; i < 2; i++) {
+        stack_size[i] = slice_size[i];
+        stack_spacing[i] = first_slice->GetSpacing()[i];
+        stack_origin[i] = first_slice->GetOrigin()[i];
+    }
+    stack_size[2] = slice_indices.size();
+    stack_spacing[2] = atlas->GetSpacing()[geometry.axis_to_collapse] * step;
+    stack_origin[2] = atlas->GetOrigin()[geometry.axis_to_collapse] + slice_indices[0] * atlas->GetSpacing()[geometry.axis_to_collapse];
+
+    typename StackImageType::Pointer stack = StackImageType::New();
+    stack->SetRegions(stack_size);
+    stack->SetSpacing(stack_spacing);
+    stack->SetOrigin(stack_origin);
+    stack->Allocate();
+
+    typename IMAGE_TYPE::PixelType* stack_buffer = stack->GetBufferPointer();
+    std::copy(first_slice->GetBufferPointer(), first_slice->GetBufferPointer() + pixels_per_slice, stack_buffer);
+
+    std::atomic<size_t> next_slice(1);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto extract_slices = [&]() {
+        try {
+            const ATLAS_POINTER_TYPE thread_atlas = get_thread_atlas(atlas);
+            for (size_t i = next_slice++; i < slice_indices.size(); i = next_slice++) {
+                typename IMAGE_TYPE::Pointer atlas_slice = extract_atlas_slice<IMAGE_TYPE>(thread_atlas, slice_indices[i], geometry, resample_threads);
+                std::copy(atlas_slice->GetBufferPointer(), atlas_slice->GetBufferPointer() + pixels_per_slice,
+                          stack_buffer + i * pixels_per_slice);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+            next_slice = slice_indices.size();
+        }
+    };
+
+    std::vector<std::thread> extractors;
+    for (unsigned int i = 0; i < extraction_threads; i++) {
+        extractors.push_back(std::thread(extract_slices));
+    }
+    for (size_t i = 0; i < extractors.size(); i++) {
+        extractors[i].join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return stack;
+}
+
+template<typename IMAGE_TYPE, typename ATLAS_POINTER_TYPE>
+void write_atlas_slices(
+    const ATLAS_POINTER_TYPE atlas,
+    const std::vector<int>& slice_indices,
+    const std::vector<int>& slice_names,
+    const SliceGeometry& geometry,
+    const char* output_path,
+    const unsigned int number_of_threads
+) {
+    // Writes the slices in slice_indices of an itk::Image or bricked atlas
+    // A single slice is written to output_path, several slices either to a filename pattern or as one stack
+    // Files written to a pattern are named with slice_names, which match slice_indices one to one
+    typedef itk::Image<typename IMAGE_TYPE::PixelType, 3> StackImageType;
+
+    if (slice_indices.size() == 1 && !is_slice_path_pattern(output_path)) {
+        typename IMAGE_TYPE::Pointer atlas_slice = extract_atlas_slice<IMAGE_TYPE>(atlas, slice_indices[0], geometry, number_of_threads);
+        write_image<IMAGE_TYPE>(atlas_slice, output_path);
+    } else if (is_slice_path_pattern(output_path)) {
+        export_slice_files<IMAGE_TYPE>(atlas, slice_indices, slice_names, geometry, output_path, number_of_threads);
+    } else {
+        typename StackImageType::Pointer stack = stack_slices<IMAGE_TYPE>(atlas, slice_indices, geometry, number_of_threads);
+        write_image<StackImageType>(stack, output_path);
+    }
 }
 
 #endif
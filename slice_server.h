@@ -0,0 +1,213 @@
+#ifndef SLICE_SERVER
+#define SLICE_SERVER
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "itkImage.h"
+
+#include "slice_atlas.h"
+
+// Serves atlas slices over a unix domain socket, so that atlases stay loaded between requests
+//
+// Each request is one line of whitespace separated key=value pairs:
+//  atlas=path index=int [axis=int] [tilt=pitch,yaw | normal=x,y,z] [interpolation=linear|nearest] [output=path]
+// When output is given the slice is written there and the reply is "OK path\n".
+// Otherwise the reply is "OK width height\n" followed by width * height pixels in the slice pixel type, in native byte order.
+// Failed requests are answered with "ERROR message\n". The line "shutdown" stops the server.
+
+inline bool send_all(const int socket_descriptor, const char* data, size_t length) {
+    // Sends length bytes of data, returns false if the client went away
+    while (length > 0) {
+        const ssize_t sent = send(socket_descriptor, data, length, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+inline bool receive_line(const int socket_descriptor, std::string& pending, std::string& line) {
+    // Reads the next newline terminated line from the socket into line
+    // pending holds data received after the previous line. Returns false when the client disconnects
+    size_t newline = pending.find('\n');
+    while (newline == std::string::npos) {
+        char chunk[4096];
+        const ssize_t received = recv(socket_descriptor, chunk, sizeof(chunk), 0);
+        if (received <= 0) {
+            return false;
+        }
+        pending.append(chunk, received);
+        newline = pending.find('\n');
+    }
+
+    line = pending.substr(0, newline);
+    pending.erase(0, newline + 1);
+    return true;
+}
+
+template<typename IMAGE_TYPE>
+std::string handle_slice_request(
+    const std::string& request,
+    std::map<std::string, typename itk::Image<typename IMAGE_TYPE::PixelType, 3>::Pointer>& atlases,
+    const bool map_atlases,
+    typename IMAGE_TYPE::Pointer& atlas_slice
+) {
+    // Extracts the slice described by request, from an atlas in atlases when possible
+    // Returns the path the slice was written to, or an empty string if the slice should be sent back in atlas_slice
+    typedef itk::Image<typename IMAGE_TYPE::PixelType, 3> AtlasImageType;
+
+    std::map<std::string, std::string> fields;
+    std::istringstream tokens(request);
+    std::string token;
+    while (tokens >> token) {
+        const size_t separator = token.find('=');
+        if (separator == std::string::npos) {
+            throw std::invalid_argument("Expected key=value, got '" + token + "'");
+        }
+        fields[token.substr(0, separator)] = token.substr(separator + 1);
+    }
+
+    if (!fields.count("atlas") || !fields.count("index")) {
+        throw std::invalid_argument("An atlas and an index must be specified");
+    }
+    if (fields.count("tilt") && fields.count("normal")) {
+        throw std::invalid_argument("Specify either a tilt or a normal for the slice plane, not both");
+    }
+
+    const int slice_index = atoi(fields["index"].c_str());
+    const int axis_to_collapse = fields.count("axis") ? atoi(fields["axis"].c_str()) : 0;
+    if (axis_to_collapse < 0 || axis_to_collapse > 2) {
+        throw std::invalid_argument("The slice axis must be 0, 1 or 2");
+    }
+
+    // Load the atlas the first time it is requested
+    typename AtlasImageType::Pointer& atlas = atlases[fields["atlas"]];
+    if (!atlas) {
+        atlas = map_atlases ? map_image<AtlasImageType>(fields["atlas"].c_str())
+                            : load_image<AtlasImageType>(fields["atlas"].c_str());
+    }
+
+    const int number_of_slices = atlas->GetLargestPossibleRegion().GetSize()[axis_to_collapse];
+    if (slice_index < 0 || slice_index >= number_of_slices) {
+        throw std::invalid_argument("Slice index " + fields["index"] + " is outside of the atlas");
+    }
+
+    SliceGeometry geometry;
+    geometry.axis_to_collapse = axis_to_collapse;
+    geometry.is_oblique = fields.count("tilt") || fields.count("normal");
+    geometry.use_nearest_neighbor = fields.count("interpolation") && parse_use_nearest_neighbor(fields["interpolation"]);
+    if (fields.count("tilt")) {
+        geometry.plane_rotation = parse_plane_tilt(fields["tilt"], axis_to_collapse);
+    } else if (fields.count("normal")) {
+        geometry.plane_rotation = parse_plane_normal(fields["normal"], axis_to_collapse);
+    }
+    atlas_slice = extract_atlas_slice<IMAGE_TYPE>(atlas, slice_index, geometry);
+
+    if (fields.count("output")) {
+        write_image<IMAGE_TYPE>(atlas_slice, fields["output"].c_str());
+        return fields["output"];
+    }
+    return "";
+}
+
+template<typename IMAGE_TYPE>
+int serve_atlas_slices(const char* socket_path, const bool map_atlases=false) {
+    // Listens on the unix domain socket at socket_path, and answers slice requests until asked to shut down
+    // Connections are handled one at a time, each connection may send any number of requests
+    typedef itk::Image<typename IMAGE_TYPE::PixelType, 3> AtlasImageType;
+    std::map<std::string, typename AtlasImageType::Pointer> atlases;
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path is too long: " << socket_path << std::endl;
+        return 1;
+    }
+    strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+
+    // Replace a stale socket left by a previous server, but never a regular file
+    struct stat socket_status;
+    if (lstat(socket_path, &socket_status) == 0 && S_ISSOCK(socket_status.st_mode)) {
+        unlink(socket_path);
+    }
+
+    const int server_descriptor = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_descriptor < 0
+            || bind(server_descriptor, (struct sockaddr*) &address, sizeof(address)) != 0
+            || listen(server_descriptor, 16) != 0) {
+        std::cerr << "Could not listen on " << socket_path << ": " << strerror(errno) << std::endl;
+        if (server_descriptor >= 0) {
+            close(server_descriptor);
+        }
+        return 1;
+    }
+
+    std::cout << "Serving atlas slices on " << socket_path << std::endl;
+
+    bool shutdown_requested = false;
+    while (!shutdown_requested) {
+        const int client_descriptor = accept(server_descriptor, NULL, NULL);
+        if (client_descriptor < 0) {
+            continue;
+        }
+
+        std::string pending;
+        std::string request;
+        bool connected = true;
+        while (connected && receive_line(client_descriptor, pending, request)) {
+            if (request == "shutdown") {
+                shutdown_requested = true;
+                connected = send_all(client_descriptor, "OK\n", 3);
+                break;
+            }
+
+            std::ostringstream reply;
+            typename IMAGE_TYPE::Pointer atlas_slice;
+            try {
+                const std::string written_path = handle_slice_request<IMAGE_TYPE>(request, atlases, map_atlases, atlas_slice);
+                if (!written_path.empty()) {
+                    reply << "OK " << written_path << "\n";
+                    connected = send_all(client_descriptor, reply.str().c_str(), reply.str().size());
+                } else {
+                    typename IMAGE_TYPE::SizeType slice_size = atlas_slice->GetLargestPossibleRegion().GetSize();
+                    reply << "OK " << slice_size[0] << " " << slice_size[1] << "\n";
+                    connected = send_all(client_descriptor, reply.str().c_str(), reply.str().size())
+                        && send_all(client_descriptor, reinterpret_cast<const char*>(atlas_slice->GetBufferPointer()),
+                                    slice_size[0] * slice_size[1] * sizeof(typename IMAGE_TYPE::PixelType));
+                }
+            } catch (std::exception & err) {
+                // itk::ExceptionObject messages span several lines, keep the reply on one
+                std::string message = err.what();
+                for (size_t i = 0; i < message.size(); i++) {
+                    if (message[i] == '\n') {
+                        message[i] = ' ';
+                    }
+                }
+                reply << "ERROR " << message << "\n";
+                connected = send_all(client_descriptor, reply.str().c_str(), reply.str().size());
+            }
+        }
+        close(client_descriptor);
+    }
+
+    close(server_descriptor);
+    unlink(socket_path);
+    return 0;
+}
+
+#endif
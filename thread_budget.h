@@ -0,0 +1,123 @@
+#ifndef THREAD_BUDGET
+#define THREAD_BUDGET
+
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <sched.h>
+
+// Helpers for sharing a node's cpus between the threads of one or more jobs
+// Inside a container the cpus visible to std::thread::hardware_concurrency can far exceed what the job may use,
+//  so the budget is taken from the cgroup cpu quota and the scheduler affinity when they are set
+
+inline bool get_cgroup_path(bool v2, std::string& path) {
+    // Finds this process's cgroup in /proc/self/cgroup, whose lines read "id:controllers:path"
+    // cgroup v2 is the line with id 0 and no controllers, cgroup v1 the line whose controllers include cpu
+    std::ifstream cgroups("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(cgroups, line)) {
+        size_t first = line.find(':');
+        size_t second = first == std::string::npos ? std::string::npos : line.find(':', first + 1);
+        if (second == std::string::npos) {
+            continue;
+        }
+        std::string controllers = "," + line.substr(first + 1, second - first - 1) + ",";
+        bool match = v2 ? line.compare(0, first, "0") == 0 && controllers == ",,"
+                        : controllers.find(",cpu,") != std::string::npos;
+        if (match) {
+            path = line.substr(second + 1);
+            if (path == "/") {
+                path.clear();
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool read_cgroup_v1_quota(const std::string& cgroup, double& quota, double& period) {
+    // The cpu controller is mounted as cpu or cpu,cpuacct depending on the distribution
+    const char* mounts[] = {"/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct"};
+    for (const char* mount : mounts) {
+        std::ifstream cfs_quota(mount + cgroup + "/cpu.cfs_quota_us");
+        std::ifstream cfs_period(mount + cgroup + "/cpu.cfs_period_us");
+        if (cfs_quota >> quota && cfs_period >> period) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline unsigned int get_cgroup_cpu_limit() {
+    // Returns the cpu quota of this process's cgroup rounded up to whole cpus, or 0 if there is none
+    // Without a cgroup namespace /sys/fs/cgroup is the host's root cgroup, so the process's own cgroup
+    // is looked up first, falling back to the root when it is not mounted where expected
+    double quota = -1;
+    double period = 0;
+
+    // cgroup v2 holds "quota period", or "max period" without a quota
+    std::string cgroup;
+    std::string quota_field;
+    std::ifstream cpu_max;
+    if (get_cgroup_path(true, cgroup)) {
+        cpu_max.open(("/sys/fs/cgroup" + cgroup + "/cpu.max").c_str());
+    }
+    if (!cpu_max.is_open()) {
+        cpu_max.open("/sys/fs/cgroup/cpu.max");
+    }
+    if (cpu_max >> quota_field >> period) {
+        quota = quota_field == "max" ? -1 : atof(quota_field.c_str());
+    } else {
+        // cgroup v1 holds a quota of -1 without a quota
+        quota = -1;
+        period = 0;
+        cgroup.clear();
+        bool found = get_cgroup_path(false, cgroup) && read_cgroup_v1_quota(cgroup, quota, period);
+        if (!found && !read_cgroup_v1_quota("", quota, period)) {
+            return 0;
+        }
+    }
+
+    if (quota <= 0 || period <= 0) {
+        return 0;
+    }
+    return static_cast<unsigned int>(ceil(quota / period));
+}
+
+inline unsigned int get_available_cpus() {
+    // Returns the number of cpus this process can use, at least 1
+    unsigned int cpus = std::thread::hardware_concurrency();
+
+    cpu_set_t affinity;
+    CPU_ZERO(&affinity);
+    if (sched_getaffinity(0, sizeof(affinity), &affinity) == 0 && CPU_COUNT(&affinity) > 0) {
+        cpus = CPU_COUNT(&affinity);
+    }
+
+    const unsigned int cgroup_limit = get_cgroup_cpu_limit();
+    if (cgroup_limit > 0 && (cpus == 0 || cgroup_limit < cpus)) {
+        cpus = cgroup_limit;
+    }
+    return cpus > 0 ? cpus : 1;
+}
+
+inline unsigned int parse_thread_count(const std::string& thread_count) {
+    // Parses a positive number of threads, or "auto" for every cpu available to this process
+    // Throws std::invalid_argument for anything else
+    if (thread_count == "auto") {
+        return get_available_cpus();
+    }
+
+    char* end = NULL;
+    const long threads = strtol(thread_count.c_str(), &end, 10);
+    if (thread_count.empty() || *end != 0 || threads < 1) {
+        throw std::invalid_argument("Expected a positive number of threads or 'auto', got '" + thread_count + "'");
+    }
+    return static_cast<unsigned int>(threads);
+}
+
+#endif